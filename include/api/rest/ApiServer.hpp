@@ -5,27 +5,51 @@
 #pragma once
 
 #include <microhttpd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <glog/logging.h>
 
+#include "api/rest/CancellationToken.hpp"
+#include "api/rest/EventStream.hpp"
+#include "api/rest/MemoryBudget.hpp"
+#include "api/rest/Published.hpp"
+#include "api/rest/SingleFlight.hpp"
+#include "api/rest/Tracing.hpp"
+#include "api/rest/WebSocket.hpp"
+
 namespace api {
 namespace rest {
 
+/** API Version: the prefix of the default `RouteGroup`. */
 extern const char *const kApiVersionPrefix;
 extern const char *const kApplicationJson;
 extern const char *const kTextHtml;
 extern const char *const kApplicationProtobuf;
 
+/**
+ * Request header carrying the client's timeout (in msec) for the request.
+ */
+extern const char *const kRequestTimeoutHeader;
+
+/** How often event stream subscribers are sent a heartbeat, unless configured otherwise. */
+extern const std::chrono::milliseconds kDefaultHeartbeatInterval;
+
 
 class HttpCannotStartError : public std::exception {
 };
 
-/** API Version */
-extern const char *const kApiVersionPrefix;
-
 
 using QueryArgs = std::map<std::string, std::string>;
 
@@ -34,7 +58,8 @@ using Headers = std::map<std::string, std::string>;
 
 class BaseRequestResponse {
  protected:
-  Headers headers_;
+  // Mutable, as a `Request` may only fetch its headers when they are first accessed.
+  mutable Headers headers_;
   std::string body_;
 
   BaseRequestResponse() = default;
@@ -66,25 +91,86 @@ class BaseRequestResponse {
   }
 };
 
+/**
+ * An HTTP request, as passed to a `Handler`.
+ *
+ * <p>Requests received by an `ApiServer` are bound to the underlying MHD connection, and
+ * look up headers and query arguments only when (and if) the handler asks for them:
+ * `headers()` and `query_args()` fetch all of them, the first time either is called.
+ *
+ * <p>A bound request is only valid while its handler runs, and must not be shared with
+ * other threads.
+ */
 class Request : public BaseRequestResponse {
 
-  QueryArgs query_args_;
+  mutable QueryArgs query_args_;
+  std::shared_ptr<CancellationToken> cancellation_token_;
+
+  MHD_Connection *connection_ = nullptr;
+  mutable bool materialized_ = false;
+
+  /** Copies all headers and query arguments from the connection, once. */
+  void Materialize() const;
+
+  static int ValuesCallback(void *request, enum MHD_ValueKind kind,
+                            const char *key, const char *value);
 
  public:
   explicit Request(const std::string &body = "") :
       BaseRequestResponse{body}, query_args_{} { }
 
-  const QueryArgs& query_args() const { return query_args_; }
+  /**
+   * Binds this request to `connection`: headers and query arguments sent by the client
+   * take precedence over those added via `AddHeader()` and `AddQueryArg()`.
+   *
+   * @param eager if `true`, all values are copied immediately, rather than when first used
+   */
+  void set_connection(MHD_Connection *connection, bool eager = false) {
+    connection_ = connection;
+    materialized_ = false;
+    if (eager) {
+      Materialize();
+    }
+  }
+
+  const Headers& headers() const {
+    Materialize();
+    return headers_;
+  }
+
+  const QueryArgs& query_args() const {
+    Materialize();
+    return query_args_;
+  }
 
   void AddQueryArg(const std::string& query, const std::string& arg) {
     query_args_[query] = arg;
   }
 
-  std::string GetQueryArg(const std::string& query) const {
-    if (query_args_.count(query) > 0) {
-      return query_args_.at(query);
-    }
-    return "";
+  /** @return the value of the `query` argument, or an empty string if it was not sent */
+  std::string GetQueryArg(const std::string& query) const;
+
+  /** @return the value of `header` (case-insensitive, if sent by the client), or "" */
+  std::string GetHeader(const std::string &header) const;
+
+  /**
+   * The token signaling whether the client is still waiting for a response to this
+   * request; this is `nullptr` for requests not received by an `ApiServer`.
+   */
+  const std::shared_ptr<CancellationToken>& cancellation_token() const {
+    return cancellation_token_;
+  }
+
+  void set_cancellation_token(std::shared_ptr<CancellationToken> token) {
+    cancellation_token_ = std::move(token);
+  }
+
+  /**
+   * @return `true` if the request's deadline has expired, or the client disconnected: the
+   *      handler should stop processing it, as the response will not be used
+   */
+  bool cancelled() const {
+    return cancellation_token_ != nullptr && cancellation_token_->cancelled();
   }
 };
 
@@ -135,6 +221,24 @@ class Response : public BaseRequestResponse {
   static Response not_found(const std::string &err_msg = "") {
     return Response(404, "NOT_FOUND", err_msg);
   }
+
+  static Response payload_too_large(const std::string &err_msg = "") {
+    return Response(413, "PAYLOAD_TOO_LARGE", err_msg);
+  }
+
+  static Response server_error(const std::string &err_msg = "") {
+    return Response(500, "INTERNAL_SERVER_ERROR", err_msg);
+  }
+
+  static Response gateway_timeout(const std::string &err_msg = "") {
+    return Response(504, "GATEWAY_TIMEOUT", err_msg);
+  }
+
+  static Response service_unavailable(const std::string &err_msg = "") {
+    auto response = Response(503, "SERVICE_UNAVAILABLE", err_msg);
+    response.AddHeader(MHD_HTTP_HEADER_RETRY_AFTER, "1");
+    return response;
+  }
 };
 
 using Handler = std::function<Response(const Request &)>;
@@ -142,8 +246,324 @@ using Handler = std::function<Response(const Request &)>;
 using ResourceHandlersMap = std::map<std::string, Handler>;
 
 /**
- * Simple Server, exposes an API as defined by the `Handler`s configured using
- * `AddMethodHandler`, and its simplified "aliases" for each HTTP method.
+ * Runs around the handler of every request served by a `RouteGroup` (e.g., to authenticate
+ * the client, or add headers to the response): it either calls `next` to continue down the
+ * chain, or short-circuits it, by returning its own response.
+ */
+using Middleware = std::function<Response(const Request &, const Handler &next)>;
+
+/**
+ * Routes resolved at compile time (see `StaticRouter`), which bypass the `RouteTable`
+ * lookup, and the type-erased `Handler`s.
+ *
+ * <p>Instances are typically `constexpr` variables, with static storage duration: the
+ * destructor is not virtual (so that implementations can be literal types), and they are
+ * never owned by the server.
+ */
+class CompiledRoutes {
+ protected:
+  ~CompiledRoutes() = default;
+
+ public:
+  /** @return the index of the route for `{method, resource}`, or `-1` if there is none */
+  virtual int Find(const std::string &method, const std::string &resource) const = 0;
+
+  /** Invokes the handler for the route at `index`, as returned by `Find()`. */
+  virtual Response Invoke(int index, const Request &request) const = 0;
+
+  virtual bool HasMethod(const std::string &method) const = 0;
+
+  virtual void ForEach(
+      const std::function<void(const std::string &, const std::string &)> &visitor) const = 0;
+};
+
+/**
+ * Limits applied to each request served by a `RouteGroup`; `0` means no limit.
+ */
+struct RouteLimits {
+  /** Requests with a larger body are rejected with a `413 Payload Too Large`. */
+  size_t max_body_size = 0;
+
+  /**
+   * Requests beyond this many in progress (including event stream subscribers, and
+   * coalesced requests waiting for their call) are rejected with a `503`.
+   */
+  unsigned int max_requests = 0;
+
+  /** Overrides the server's `set_request_timeout()`, if not `0`. */
+  std::chrono::milliseconds request_timeout{0};
+};
+
+/**
+ * An immutable snapshot of all the routes served by a `RouteGroup`.
+ *
+ * <p>A table is never modified once published by the `Router`: a request is routed using
+ * the snapshot current at the time it arrived, for its whole duration.
+ */
+struct RouteTable {
+  std::map<std::string, ResourceHandlersMap> handlers;
+  std::map<std::string, std::shared_ptr<EventBroadcaster>> streams;
+  std::map<std::string, std::shared_ptr<WebSocketEndpoint>> websockets;
+  const CompiledRoutes *compiled = nullptr;
+
+  // GET resources whose concurrent identical requests are served by a single handler call.
+  std::map<std::string, std::shared_ptr<SingleFlight>> coalesced;
+
+  // Resources (by method) whose handlers get all headers and query arguments copied
+  // upfront, rather than looked up when used.
+  std::map<std::string, std::set<std::string>> eager_values;
+
+  // Run, in order, around every handler (but not event streams and WebSockets).
+  std::vector<Middleware> middleware;
+  RouteLimits limits;
+
+  /**
+   * Invokes `handler` via the `middleware` chain, starting from the `next` one.
+   *
+   * <p>Each middleware gets the rest of the chain as a `Handler` which only refers to it
+   * (a single pointer, kept on the stack), small enough for `std::function` to store it
+   * without allocating: calling through the chain allocates nothing per request.
+   */
+  template <typename F>
+  Response Invoke(const F &handler, const Request &request, size_t next = 0) const {
+    if (next == middleware.size()) {
+      return handler(request);
+    }
+    struct Rest {
+      const RouteTable *routes;
+      const F *handler;
+      size_t next;
+    } rest{this, &handler, next + 1};
+    return middleware[next](request, [&rest](const Request &req) {
+      return rest.routes->Invoke(*rest.handler, req, rest.next);
+    });
+  }
+
+  bool HasMethod(const std::string &method) const {
+    return handlers.find(method) != handlers.end() ||
+        (method == "GET" && !(streams.empty() && websockets.empty())) ||
+        (compiled != nullptr && compiled->HasMethod(method));
+  }
+
+  /**
+   * @return the handler registered for `method` and `resource`, or `nullptr` if there
+   *      is none
+   */
+  const Handler *FindHandler(const std::string &method, const std::string &resource) const {
+    auto method_handlers = handlers.find(method);
+    if (method_handlers == handlers.end()) {
+      return nullptr;
+    }
+    auto handler = method_handlers->second.find(resource);
+    return handler != method_handlers->second.end() ? &handler->second : nullptr;
+  }
+
+  /** @return whether the handler for `method` and `resource` wants eager request values */
+  bool EagerValues(const std::string &method, const std::string &resource) const {
+    auto resources = eager_values.find(method);
+    return resources != eager_values.end() && resources->second.count(resource) > 0;
+  }
+};
+
+/**
+ * Publishes the `RouteTable` used by a `RouteGroup`, so that routes can be safely added
+ * or removed while the server is running.
+ *
+ * <p>Readers never lock (see `Published`): they take a reference to the current table,
+ * which stays valid for as long as they hold it. Writers (which are serialized) copy the
+ * table, modify the copy and publish it, so that requests in flight are unaffected.
+ */
+class Router {
+  Published<RouteTable> table_;
+  std::mutex update_mutex_;
+
+ public:
+  Router() : table_(std::make_shared<const RouteTable>()) {}
+
+  Router(const Router &) = delete;
+
+  std::shared_ptr<const RouteTable> routes() const { return table_.get(); }
+
+  /**
+   * Applies `mutation` to a copy of the current table, then publishes it.
+   */
+  void Update(const std::function<void(RouteTable *)> &mutation) {
+    std::lock_guard<std::mutex> lock(update_mutex_);
+    auto updated = std::make_shared<RouteTable>(*table_.get());
+    mutation(updated.get());
+    table_.set(std::move(updated));
+  }
+};
+
+/**
+ * Routes served under a common path prefix (e.g., `/api/v2`, or `/tenants/acme/api/v1`),
+ * which share the same middleware chain and `RouteLimits`: this way, several API versions
+ * (or tenants) can be served by a single `ApiServer`, see `ApiServer::AddRouteGroup()`.
+ *
+ * <p>A request for `{prefix}/.../{resource}` is served by the group with the longest
+ * matching prefix, using the handler registered there for `resource`.
+ *
+ * <p>Handlers (and event streams, and WebSockets), middleware and limits can be changed at
+ * any time, also while the server is running: requests in flight are not affected.
+ */
+class RouteGroup {
+  friend class ApiServer;
+
+  std::string prefix_;
+  WebSocketRegistry *websocket_sessions_;
+  MemoryBudget *budget_;
+  Router router_;
+
+  // Requests currently being served, counted only while `max_requests` is set.
+  std::atomic<unsigned int> active_{0};
+
+  // Removed coalesced routes may still have calls in flight (which keep them alive), to be
+  // drained before the server stops; expired ones are dropped as new ones are added.
+  std::mutex removed_flights_mutex_;
+  std::vector<std::weak_ptr<SingleFlight>> removed_flights_;
+
+  /** Keeps track of `flights`, removed from the routes, until it is no longer in use. */
+  void RemovedFlights(std::shared_ptr<SingleFlight> flights);
+
+  void AddMethodHandler(const std::string &method, const std::string &resource,
+                        const Handler &handler, bool eager_values);
+
+  /** @return whether a request can be served, without exceeding `limit` concurrent ones */
+  bool Admit(unsigned int limit);
+
+  void Leave() { --active_; }
+
+  /** Ends all the event streams, resuming their (suspended) connections. */
+  void CloseStreams();
+
+  /** Waits for all coalesced calls in flight to complete. */
+  void DrainFlights();
+
+ public:
+  /** @param budget accounts for the backlogs of the group's event streams, if not null */
+  RouteGroup(std::string prefix, WebSocketRegistry *websocket_sessions,
+             MemoryBudget *budget = nullptr) :
+      prefix_(std::move(prefix)), websocket_sessions_(websocket_sessions), budget_(budget) {}
+
+  RouteGroup(const RouteGroup &) = delete;
+
+  const std::string &prefix() const { return prefix_; }
+
+  std::shared_ptr<const RouteTable> routes() const { return router_.routes(); }
+
+  /**
+   * Appends `middleware` to the chain run around the handler of every request served by
+   * this group; the first one added is the outermost.
+   *
+   * <p>For coalesced GETs (see `AddCoalescedGet()`) the chain runs once per call, and only
+   * sees the query arguments, like the handler.
+   */
+  void Use(const Middleware &middleware);
+
+  void set_limits(const RouteLimits &limits);
+
+  RouteLimits limits() const { return routes()->limits; }
+
+  /**
+   * Serves GET requests for `resource` with `handler`.
+   *
+   * <p>By default, headers and query arguments are only looked up when the handler asks for
+   * them (see `Request`); if it uses `headers()` or `query_args()`, or most of the values,
+   * set `eager_values` to copy them all upfront, in a single pass. The same applies to the
+   * other methods.
+   */
+  void AddGet(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    AddMethodHandler("GET", resource, handler, eager_values);
+  }
+
+  /**
+   * Like `AddGet()`, but concurrent requests for `resource` with the same query arguments
+   * are coalesced: they all wait for a single call to `handler` (run on a separate thread),
+   * and receive the same response.
+   *
+   * <p>Use it for expensive handlers whose response only depends on the query arguments
+   * (not on the headers, nor on who the client is), to avoid a "thundering herd" of
+   * identical calls when many clients ask for the same thing at the same time.
+   */
+  void AddCoalescedGet(const std::string &resource, const Handler &handler);
+
+  void AddPost(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    AddMethodHandler("POST", resource, handler, eager_values);
+  }
+
+  void AddPut(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    AddMethodHandler("PUT", resource, handler, eager_values);
+  }
+
+  void AddDelete(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    AddMethodHandler("DELETE", resource, handler, eager_values);
+  }
+
+  /**
+   * Removes the handler for `{method, resource}`; requests already being processed
+   * will complete normally, new ones will receive a 404.
+   *
+   * @return whether a handler was registered
+   */
+  bool RemoveMethodHandler(const std::string &method, const std::string &resource);
+
+  /**
+   * Serves the routes resolved at compile time by `routes` (see `StaticRouter`); these
+   * take precedence over handlers registered at runtime for the same route.
+   *
+   * <p>`routes` is not owned by the group, and must outlive the server; pass `nullptr` to
+   * remove them.
+   */
+  void SetCompiledRoutes(const CompiledRoutes *routes);
+
+  /**
+   * Registers a `text/event-stream` endpoint for `resource`: a GET will keep the
+   * connection open, and stream to the client every event published via the returned
+   * `EventBroadcaster`.
+   *
+   * <p>Clients that do not `Accept: text/event-stream` are treated as "long-poll" ones:
+   * the response will complete as soon as the next event is delivered.
+   *
+   * @return the broadcaster used to push events to all the connected clients
+   */
+  std::shared_ptr<EventBroadcaster> AddEventStream(const std::string &resource);
+
+  /**
+   * Removes the event stream for `resource`, ending the stream for all current
+   * subscribers.
+   *
+   * @return whether an event stream was registered
+   */
+  bool RemoveEventStream(const std::string &resource);
+
+  /**
+   * Registers a WebSocket endpoint for `resource`: a GET carrying a valid WebSocket
+   * handshake will be upgraded, and `handler` invoked for every message received on the
+   * connection.
+   *
+   * <p>Replies can be sent back via `WebSocketSession::Send()`, either from within the
+   * handler, or at any later time.
+   */
+  void AddWebSocket(const std::string &resource, const WebSocketHandler &handler);
+
+  /**
+   * Stops accepting WebSocket connections for `resource`; established sessions are not
+   * affected.
+   *
+   * @return whether a WebSocket endpoint was registered
+   */
+  bool RemoveWebSocket(const std::string &resource);
+
+  std::ostream &ListAllHandlers(std::ostream &out) const;
+};
+
+/** The route groups served by an `ApiServer`, by prefix. */
+using RouteGroups = std::unordered_map<std::string, std::shared_ptr<RouteGroup>>;
+
+/**
+ * Simple Server, exposes an API as defined by the `Handler`s configured in each of its
+ * `RouteGroup`s; `AddGet()` and its siblings for the other HTTP methods add them to the
+ * default one, served under `kApiVersionPrefix`.
  *
  * Uses GNU `libmicrohttpd` as the underlying HTTP daemon.
  *
@@ -155,8 +575,36 @@ using ResourceHandlersMap = std::map<std::string, Handler>;
  */
 class ApiServer {
   unsigned int port_;
+  std::string unix_socket_;
+  MHD_socket listen_socket_ = MHD_INVALID_SOCKET;
   struct MHD_Daemon *httpd_;
-  std::map<std::string, ResourceHandlersMap> handlers_;
+  unsigned int connection_limit_ = 0;
+  size_t connection_memory_limit_ = 0;
+  bool external_event_loop_ = false;
+  std::chrono::milliseconds request_timeout_{0};
+  std::chrono::milliseconds heartbeat_interval_{kDefaultHeartbeatInterval};
+  std::shared_ptr<Tracer> tracer_;
+  MemoryBudget memory_budget_;
+  WebSocketRegistry websocket_sessions_;
+
+  // Published like the `RouteTable`s (see `Router`): readers never lock, writers hold
+  // `groups_mutex_`.
+  Published<RouteGroups> groups_{std::make_shared<const RouteGroups>()};
+  std::mutex groups_mutex_;
+  std::shared_ptr<RouteGroup> default_group_;
+
+  // Removed groups may still be serving requests (which keep them alive), to be closed and
+  // drained before the server stops; only accessed holding `groups_mutex_`.
+  std::vector<std::weak_ptr<RouteGroup>> removed_groups_;
+
+  // Sends heartbeats to the event streams' subscribers, every `heartbeat_interval_`.
+  std::thread heartbeat_;
+  std::mutex heartbeat_mutex_;
+  std::condition_variable heartbeat_cv_;
+  bool stopped_ = false;
+
+  /** Sends a heartbeat to the subscribers of every event stream, in every group. */
+  void SendHeartbeats();
 
   static int ConnectCallback(void *cls, struct MHD_Connection *connection,
                              const char *url,
@@ -166,73 +614,297 @@ class ApiServer {
                              size_t *upload_data_size,
                              void **con_cls);
 
-  static int HeadersQueryargsCallback(void *request, enum MHD_ValueKind kind,
-                                      const char *key, const char *value);
+  static void RequestCompletedCallback(void *cls, struct MHD_Connection *connection,
+                                       void **con_cls,
+                                       enum MHD_RequestTerminationCode toe);
+
+  /** Refuses new connections, when their buffers would not fit in the memory budget. */
+  static int AcceptPolicyCallback(void *cls, const struct sockaddr *addr, socklen_t addrlen);
+
+  /** Accounts for the connections' buffers in the memory budget. */
+  static void ConnectionNotifyCallback(void *cls, struct MHD_Connection *connection,
+                                       void **socket_context,
+                                       enum MHD_ConnectionNotificationCode toe);
+
+  /** The memory allocated by libmicrohttpd for each connection's buffers. */
+  size_t ConnectionMemory() const;
+
+  /**
+   * The deadline for a request arriving now, taking into account both the `timeout` (see
+   * `DefaultTimeout()`) and the client's `kRequestTimeoutHeader` (whichever is shorter).
+   */
+  std::chrono::steady_clock::time_point RequestDeadline(
+      MHD_Connection *connection, std::chrono::milliseconds timeout) const;
+
+  /**
+   * The timeout for requests served by `routes`, regardless of what clients ask for: the
+   * group's own, if any, or else the server's `request_timeout_`.
+   */
+  std::chrono::milliseconds DefaultTimeout(const RouteTable &routes) const;
+
+  /**
+   * Finds the group serving `path`, scanning it once, from the end: each prefix ending
+   * before a `/` is looked up, longest first, and the last segment is the resource.
+   *
+   * @return the group, or `nullptr` if there is none
+   */
+  std::shared_ptr<RouteGroup> FindRouteGroup(const std::string &path,
+                                             std::string *resource) const;
+
+  /**
+   * Invokes `handler` via the `routes` middleware, unless the request's deadline has
+   * already expired; if it expires while the handler is running, its response is
+   * discarded, and a 504 returned instead.
+   */
+  template <typename F>
+  static Response InvokeHandler(const F &handler, const Request &request,
+                                const RouteTable &routes, RequestTrace *trace);
+
+  static int SubscribeToStream(MHD_Connection *connection, EventBroadcaster &broadcaster);
+
+  /**
+   * Suspends `connection` until `handler` has produced a response for `request`, either
+   * in a call started now, or in one already in flight for an identical request.
+   *
+   * <p>The call is shared by all the waiting clients, thus it runs with the `timeout` for
+   * the route, rather than with any one client's deadline: each waiter's own deadline is
+   * checked when it is resumed.
+   */
+  static std::shared_ptr<const SingleFlight::Flight> CoalesceRequest(
+      MHD_Connection *connection, SingleFlight &flights, const Handler &handler,
+      const Request &request, const std::string &resource,
+      std::shared_ptr<const RouteTable> routes, std::chrono::milliseconds timeout,
+      MemoryBudget *budget);
+
+  /** Converts `response` to one that can be queued on a connection. */
+  static MHD_Response *CreateResponse(const Response &response);
+
+  /**
+   * Creates a listening socket bound to `unix_socket_`, replacing a stale socket file
+   * left behind by a previous run, if any.
+   *
+   * @throws HttpCannotStartError if the socket cannot be created or bound
+   */
+  MHD_socket BindUnixSocket() const;
+
+  static int UpgradeToWebSocket(MHD_Connection *connection, WebSocketEndpoint &endpoint);
 
-  void AddMethodHandler(const std::string &method, const std::string &resource,
-                        const Handler &handler);
+ public:
+  explicit ApiServer(unsigned int port);
+
+  /**
+   * Starts the HTTP daemon, which will use its own internal thread to poll the
+   * connections (using `epoll` on Linux, so we are not bound by `FD_SETSIZE`), unless
+   * an external event loop is used (see `set_external_event_loop()`).
+   *
+   * @throws HttpCannotStartError if the daemon cannot be started
+   */
+  void Start();
+
+  /**
+   * Instead of running its own thread, the server is driven by the caller's event loop:
+   * on Linux, by polling `epoll_fd()` for reads, on other platforms the sockets returned by
+   * `GetFdSet()`; either way, at most for `NextTimeout()` msec, then calling `RunOnce()`.
+   *
+   * <p>Handlers are then run on the event loop's thread, with two exceptions, which must
+   * synchronize any state they share with the loop: coalesced GETs (see
+   * `AddCoalescedGet()`), whose handlers and middleware run on the `SingleFlight` worker
+   * threads; and WebSocket handlers (see `AddWebSocket()`), which run on each session's
+   * own thread.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_external_event_loop(bool external) { external_event_loop_ = external; }
+
+  /**
+   * Processes all the pending events on the server's sockets (accepting connections,
+   * reading requests, running handlers and sending responses), without blocking.
+   *
+   * <p>Only used with an external event loop, and always from the same thread.
+   */
+  void RunOnce();
+
+  /**
+   * With an external event loop on Linux, the `epoll` file descriptor which becomes
+   * readable whenever the server has events to process; `-1` on other platforms, or when
+   * the server uses its own thread.
+   */
+  int epoll_fd() const;
+
+  /**
+   * Adds the server's sockets to the given sets, for use with `select()`.
+   *
+   * @param max_fd updated to the highest file descriptor added, if higher
+   * @return `false` if the sockets could not be added (e.g., one is over `FD_SETSIZE`)
+   */
+  bool GetFdSet(fd_set *read_fds, fd_set *write_fds, fd_set *except_fds,
+                MHD_socket *max_fd) const;
+
+  /**
+   * @return how long (in msec) the event loop may wait for events, before calling
+   *      `RunOnce()` regardless (e.g., to time out idle connections); `-1` if there is no
+   *      such limit, as expected by `epoll_wait()` and `poll()`
+   */
+  long NextTimeout() const;
+
+  virtual ~ApiServer();
+
+  /**
+   * Accepts connections on a Unix domain socket at `path`, instead of the TCP port: this
+   * avoids the TCP stack overhead for clients on the same host (e.g., a sidecar proxy).
+   *
+   * <p>If `path` starts with `@` the socket is bound in the (Linux-only) abstract
+   * namespace, with the rest of `path` as its name, and no file is created.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_unix_socket(const std::string &path) { unix_socket_ = path; }
+
+  /**
+   * Accepts connections on `fd`, an already bound and listening socket (e.g., one
+   * inherited via systemd socket activation), instead of the TCP port.
+   *
+   * <p>The server takes ownership of `fd`, which is closed when the server stops.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_listen_socket(MHD_socket fd) { listen_socket_ = fd; }
+
+  /** @return where the server accepts connections, for logging */
+  std::string address() const;
+
+  /**
+   * Maximum number of concurrent connections that the server will accept; if `0` (the
+   * default) libmicrohttpd's own default is used, which is typically too low for servers
+   * that hold many long-lived event streams open.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_connection_limit(unsigned int limit) { connection_limit_ = limit; }
+
+  /**
+   * Idle event stream subscribers are sent a comment this often (see
+   * `EventBroadcaster::Heartbeat()`): otherwise, a client that went away would only be found
+   * out when the next event is published, and keep its connection (and its `RouteLimits`
+   * admission) until then; `0` disables heartbeats.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_heartbeat_interval(std::chrono::milliseconds interval) {
+    heartbeat_interval_ = interval;
+  }
 
-  bool HasMethod(const std::string &method) const {
-    return handlers_.find(method) != handlers_.end();
+  /**
+   * Default time allowed to handle a request, before the server gives up and returns a
+   * 504 (Gateway Timeout) to the client; if `0` (the default) requests never time out,
+   * unless the client specifies a timeout via the `kRequestTimeoutHeader` header, or their
+   * `RouteGroup` sets its own (see `RouteLimits`).
+   *
+   * <p>Handlers can check `Request::cancelled()` to stop processing requests whose
+   * deadline has expired.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_request_timeout(std::chrono::milliseconds timeout) { request_timeout_ = timeout; }
+
+  /**
+   * Limits the memory used to serve requests (connection buffers, request and response
+   * bodies, WebSocket buffers) to `bytes`: once the budget is exhausted, new connections
+   * are refused, and requests are rejected with a `503 Service Unavailable`, until memory
+   * is released by those in progress. If `0` (the default) memory usage is only tracked.
+   *
+   * <p>Can be changed at any time; see `memory_budget()` for the current usage.
+   */
+  void set_memory_budget(size_t bytes) { memory_budget_.set_limit(bytes); }
+
+  const MemoryBudget &memory_budget() const { return memory_budget_; }
+
+  /**
+   * The memory libmicrohttpd allocates for each connection, to buffer the request headers
+   * and the response (`MHD_OPTION_CONNECTION_MEMORY_LIMIT`); if `0` (the default)
+   * libmicrohttpd's own default (32 KiB) is used.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_connection_memory_limit(size_t bytes) { connection_memory_limit_ = bytes; }
+
+  /**
+   * Records how long requests spend in each `TracePhase`, for the fraction of them sampled
+   * by `tracer`; when no tracer is set (the default) no timings are taken.
+   *
+   * <p>Must be set before `Start()` is called.
+   */
+  void set_tracer(std::shared_ptr<Tracer> tracer) { tracer_ = std::move(tracer); }
+
+  /**
+   * Serves the routes of the returned group under `prefix` (e.g., `/api/v2`, or
+   * `/tenants/acme/api/v1`), alongside those of all the other groups: if a group already
+   * exists for `prefix`, that one is returned.
+   *
+   * <p>Groups can be added and removed at any time, also while the server is running.
+   */
+  std::shared_ptr<RouteGroup> AddRouteGroup(std::string prefix);
+
+  /**
+   * Stops serving the group for `prefix`, ending its event streams; requests already
+   * being processed will complete normally, new ones will receive a 404.
+   *
+   * <p>The default group (`kApiVersionPrefix`) cannot be removed.
+   *
+   * @return whether the group was removed
+   */
+  bool RemoveRouteGroup(const std::string &prefix);
+
+  // The methods below act on the default group: see `RouteGroup` for their details.
+
+  void AddGet(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    default_group_->AddGet(resource, handler, eager_values);
   }
 
- public:
-  explicit ApiServer(unsigned int port) : port_(port) {}
-
-  void Start() {
-    LOG(INFO) << "Starting HTTP API Server on port " << std::to_string(port_);
-    httpd_ = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY,
-                              port_,
-                              nullptr,    // Allow all clients to connect
-                              nullptr,
-                              ApiServer::ConnectCallback,
-                              (void *) this,       // The GFD as the extra arguments.
-                              MHD_OPTION_END);  // No extra options to daemon either.
-
-    if (httpd_ == nullptr) {
-      LOG(ERROR) << "HTTPD Daemon could not be started";
-      throw HttpCannotStartError();
-    }
-    LOG(INFO) << "API available at http://localhost:" << std::to_string(port_)
-              << kApiVersionPrefix << "/*";
+  void AddCoalescedGet(const std::string &resource, const Handler &handler) {
+    default_group_->AddCoalescedGet(resource, handler);
   }
 
-  virtual ~ApiServer() {
-    LOG(INFO) << "Stopping HTTP API Server";
-    if (httpd_ != nullptr)
-      MHD_stop_daemon(httpd_);
+  void AddPost(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    default_group_->AddPost(resource, handler, eager_values);
   }
 
-  void AddGet(const std::string &resource, const Handler &handler) {
-    AddMethodHandler("GET", resource, handler);
+  void AddPut(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    default_group_->AddPut(resource, handler, eager_values);
   }
 
-  void AddPost(const std::string &resource, const Handler &handler) {
-    AddMethodHandler("POST", resource, handler);
+  void AddDelete(const std::string &resource, const Handler &handler, bool eager_values = false) {
+    default_group_->AddDelete(resource, handler, eager_values);
   }
 
-  void AddPut(const std::string &resource, const Handler &handler) {
-    AddMethodHandler("PUT", resource, handler);
+  bool RemoveMethodHandler(const std::string &method, const std::string &resource) {
+    return default_group_->RemoveMethodHandler(method, resource);
   }
 
-  void AddDelete(const std::string &resource, const Handler &handler) {
-    AddMethodHandler("DELETE", resource, handler);
+  void SetCompiledRoutes(const CompiledRoutes *routes) {
+    default_group_->SetCompiledRoutes(routes);
   }
 
-  std::ostream &ListAllHandlers(std::ostream &out) const {
-    out << "====\nAll handlers for server on port: " << port_ << "\n====\n";
-    for (const auto& methodHandlers : handlers_) {
-      out << "Method: " << methodHandlers.first << std::endl;
-      for (const auto& handler : methodHandlers.second) {
-        out << "\t" << handler.first << std::endl;
-      }
-      out << "--\n";
-    }
-    out << "=====\n";
-    return out;
+  std::shared_ptr<EventBroadcaster> AddEventStream(const std::string &resource) {
+    return default_group_->AddEventStream(resource);
   }
 
-  static int sendResponse(MHD_Connection *connection, const Response &response);
+  bool RemoveEventStream(const std::string &resource) {
+    return default_group_->RemoveEventStream(resource);
+  }
+
+  void AddWebSocket(const std::string &resource, const WebSocketHandler &handler) {
+    default_group_->AddWebSocket(resource, handler);
+  }
+
+  bool RemoveWebSocket(const std::string &resource) {
+    return default_group_->RemoveWebSocket(resource);
+  }
+
+  std::ostream &ListAllHandlers(std::ostream &out) const;
+
+  static int sendResponse(MHD_Connection *connection, const Response &response,
+                          RequestTrace *trace = nullptr);
   static int ResourceNotFound(MHD_Connection *connection, const std::string &resource);
 };
 
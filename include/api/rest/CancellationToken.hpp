@@ -0,0 +1,87 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/23/20.
+
+
+#pragma once
+
+#include <microhttpd.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace api {
+namespace rest {
+
+/**
+ * Signals to a `Handler` that the result of the request it is processing is no longer
+ * needed: either because the request's deadline has expired, or because the client went
+ * away.
+ *
+ * <p>Handlers performing lengthy computations should periodically check `cancelled()`
+ * and bail out early; alternatively (e.g., when handing off work to other threads), they
+ * can register callbacks via `OnCancel()`.
+ *
+ * <p>Cancellation is detected lazily: when the connection is closed by the server, when
+ * the deadline is found to be expired, or when probing the client's socket (from within
+ * `cancelled()`) shows it has been closed; callbacks are run on the thread that detects
+ * it.
+ *
+ * <p>In particular, there is no timer: callbacks registered via `OnCancel()` are not run
+ * as soon as the deadline expires, but only once something calls `cancelled()` (or the
+ * server completes the request).
+ */
+class CancellationToken {
+  using Clock = std::chrono::steady_clock;
+
+  Clock::time_point deadline_;
+  std::atomic<MHD_socket> socket_;
+
+  std::atomic<bool> cancelled_;
+  std::mutex mutex_;
+  std::vector<std::function<void()>> callbacks_;
+
+  bool PeerClosed() const;
+
+ public:
+  /**
+   * @param deadline the time by which the request must be completed
+   * @param socket the client's connection, which will be probed to detect if the client
+   *      disconnects; if `MHD_INVALID_SOCKET`, only the deadline will be checked
+   */
+  explicit CancellationToken(Clock::time_point deadline = Clock::time_point::max(),
+                             MHD_socket socket = MHD_INVALID_SOCKET) :
+      deadline_(deadline), socket_(socket), cancelled_(false) {}
+
+  CancellationToken(const CancellationToken &) = delete;
+
+  Clock::time_point deadline() const { return deadline_; }
+
+  bool expired() const { return Clock::now() >= deadline_; }
+
+  /** Time left before the deadline expires; zero, if it already has. */
+  std::chrono::milliseconds remaining() const;
+
+  /**
+   * @return whether the request has been cancelled; this also checks whether the deadline
+   *      has expired, or the client has disconnected, in which case the token is cancelled
+   */
+  bool cancelled();
+
+  /** Cancels the request, running all the registered callbacks (only the first time). */
+  void Cancel();
+
+  /**
+   * Registers a callback to be run when the request is cancelled; if it already was, the
+   * callback is run immediately.
+   */
+  void OnCancel(const std::function<void()> &callback);
+
+  /** The server is done with the connection: the socket must no longer be probed. */
+  void Detach() { socket_ = MHD_INVALID_SOCKET; }
+};
+
+} // namespace rest
+} // namespace api
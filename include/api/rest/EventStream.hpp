@@ -0,0 +1,206 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/2/20.
+
+
+#pragma once
+
+#include <microhttpd.h>
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "api/rest/MemoryBudget.hpp"
+
+namespace api {
+namespace rest {
+
+extern const char *const kTextEventStream;
+
+class EventBroadcaster;
+
+/**
+ * An immutable, already serialized event: the same buffer is shared by every subscriber
+ * it is delivered to, so that formatting (and memory) is paid once per event, not once per
+ * client.
+ */
+using EventBuffer = std::shared_ptr<const std::string>;
+
+/**
+ * A single client connected to an `EventBroadcaster`.
+ *
+ * <p>Events are queued (by reference) as they are published, and drained by libmicrohttpd
+ * via `ContentReaderCallback` as the socket becomes writable; when there is nothing left
+ * to send, the connection is suspended, so that an idle subscriber costs neither a thread
+ * nor a spot in the daemon's polling set, and is resumed as soon as a new event is queued.
+ *
+ * <p>A "long-poll" subscriber will end its response as soon as the first event has been
+ * fully delivered; an SSE subscriber will keep the stream open until the client goes away,
+ * or the broadcaster is closed.
+ *
+ * <p>Each queued entry is accounted for in the broadcaster's memory budget (if any), until
+ * it is delivered; a subscriber whose backlog does not fit in it is closed.
+ */
+class EventSubscriber {
+  friend class EventBroadcaster;
+
+  EventBroadcaster *broadcaster_;
+  struct MHD_Connection *connection_;
+  bool long_poll_;
+  MemoryBudget *budget_;
+
+  // A connection keeps its broadcaster alive (even if it is removed from the server) until
+  // libmicrohttpd is done with the response.
+  std::shared_ptr<EventBroadcaster> owner_;
+
+  std::mutex mutex_;
+  std::deque<EventBuffer> pending_;
+  size_t offset_ = 0;
+  bool suspended_ = false;
+  bool delivered_ = false;
+  bool closed_ = false;
+
+  /**
+   * Queues the `event`, and wakes up the connection if it was suspended waiting for one.
+   *
+   * @return `false` if the subscriber has been closed, or has too many events still
+   *      pending, or no room for this one in the memory budget (in which case, it will be
+   *      closed too)
+   */
+  bool Push(const EventBuffer &event, size_t max_pending);
+
+  /**
+   * Queues a comment (which clients ignore) if there is nothing else to send, so that the
+   * connection is written to, and closed by libmicrohttpd if the client has gone away.
+   *
+   * @return `false` if the subscriber has been closed
+   */
+  bool Ping();
+
+ public:
+  EventSubscriber(EventBroadcaster *broadcaster, struct MHD_Connection *connection,
+                  bool long_poll, MemoryBudget *budget = nullptr) :
+      broadcaster_(broadcaster), connection_(connection), long_poll_(long_poll),
+      budget_(budget) {}
+
+  EventSubscriber(const EventSubscriber &) = delete;
+
+  ~EventSubscriber();
+
+  /**
+   * Copies at most `max` bytes of pending events into `buf`.
+   *
+   * @return the number of bytes copied; `0` if there are no events pending (and the
+   *      connection, if any, has been suspended); or `MHD_CONTENT_READER_END_OF_STREAM` if
+   *      the stream is complete
+   */
+  ssize_t Read(char *buf, size_t max);
+
+  /** Ends the stream, once all the events already queued have been sent. */
+  void Close();
+
+  bool closed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+  }
+
+  size_t pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.size();
+  }
+
+  static ssize_t ContentReaderCallback(void *cls, uint64_t pos, char *buf, size_t max);
+
+  static void ContentReaderFreeCallback(void *cls);
+};
+
+/**
+ * Fans out events to all the clients subscribed to an event stream, registered with
+ * `ApiServer::AddEventStream()`.
+ *
+ * <p>Each event is formatted according to the `text/event-stream` specification exactly
+ * once, and the resulting buffer shared across all subscribers.
+ *
+ * <p>If given a `MemoryBudget`, the events' buffers are accounted for in it (once each) until
+ * they have been delivered to all the subscribers, as are the subscribers' backlogs: events
+ * that do not fit are not published.
+ *
+ * @see https://html.spec.whatwg.org/multipage/server-sent-events.html
+ */
+class EventBroadcaster : public std::enable_shared_from_this<EventBroadcaster> {
+  /** Default upper bound for the number of undelivered events per subscriber. */
+  static const size_t kDefaultMaxPending = 1024;
+
+  std::string resource_;
+  MemoryBudget *budget_;
+  size_t max_pending_ = kDefaultMaxPending;
+
+  std::mutex mutex_;
+  std::unordered_map<const EventSubscriber *, std::shared_ptr<EventSubscriber>> subscribers_;
+  bool closed_ = false;
+
+ public:
+  explicit EventBroadcaster(std::string resource, MemoryBudget *budget = nullptr) :
+      resource_(std::move(resource)), budget_(budget) {}
+
+  EventBroadcaster(const EventBroadcaster &) = delete;
+
+  virtual ~EventBroadcaster() { Close(); }
+
+  const std::string &resource() const { return resource_; }
+
+  /**
+   * Subscribers that fall behind by more than `max_pending` events are disconnected,
+   * instead of letting their backlog grow unbounded.
+   */
+  void set_max_pending(size_t max_pending) { max_pending_ = max_pending; }
+
+  size_t subscribers_count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return subscribers_.size();
+  }
+
+  /**
+   * Adds a new subscriber; `connection` may be `nullptr` (in which case the caller is
+   * expected to drain events via `EventSubscriber::Read()` directly).
+   */
+  std::shared_ptr<EventSubscriber> Subscribe(struct MHD_Connection *connection,
+                                             bool long_poll = false);
+
+  void Unsubscribe(const EventSubscriber *subscriber);
+
+  /**
+   * Sends the event to all current subscribers.
+   *
+   * @param data the event's payload; may span multiple lines
+   * @param event the (optional) event type
+   * @param id the (optional) event ID
+   * @return the number of subscribers the event was queued for; `0` if it does not fit in
+   *      the memory budget
+   */
+  size_t Publish(const std::string &data, const std::string &event = "",
+                 const std::string &id = "");
+
+  /**
+   * Sends a comment to all idle subscribers (see `ApiServer::set_heartbeat_interval()`), so
+   * that those whose client went away are found out; long-poll subscribers still wait for
+   * the next event.
+   *
+   * @return the number of subscribers still open
+   */
+  size_t Heartbeat();
+
+  /** Ends the stream for all current subscribers, and rejects new ones. */
+  void Close();
+
+  /**
+   * Serializes the event according to the `text/event-stream` format.
+   */
+  static std::string FormatEvent(const std::string &data, const std::string &event = "",
+                                 const std::string &id = "");
+};
+
+} // namespace rest
+} // namespace api
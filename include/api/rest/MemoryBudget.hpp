@@ -0,0 +1,135 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/27/20.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace api {
+namespace rest {
+
+/**
+ * Accounts for the memory used to serve requests (connection buffers, request and
+ * response bodies, I/O buffers), against a global limit: once it is reached, the server
+ * sheds load (refusing connections, or replying `503 Service Unavailable`) rather than
+ * risk running out of memory.
+ *
+ * <p>All methods are thread-safe, and lock-free.
+ */
+class MemoryBudget {
+  std::atomic<size_t> limit_;
+  std::atomic<size_t> used_{0};
+  std::atomic<size_t> peak_{0};
+  std::atomic<uint64_t> rejected_{0};
+
+  void UpdatePeak(size_t used);
+
+ public:
+  /** @param limit the budget, in bytes; `0` (the default) means unlimited */
+  explicit MemoryBudget(size_t limit = 0) : limit_(limit) {}
+
+  MemoryBudget(const MemoryBudget &) = delete;
+
+  /**
+   * Reserves `bytes` from the budget, unless that would exceed the limit.
+   *
+   * @return whether the bytes were reserved; if not, the caller should shed the request
+   */
+  bool Reserve(size_t bytes);
+
+  /** Accounts for `bytes` which are already in use, even if that exceeds the limit. */
+  void ForceReserve(size_t bytes);
+
+  void Release(size_t bytes);
+
+  /** @return whether `bytes` could be reserved right now */
+  bool Fits(size_t bytes) const;
+
+  size_t limit() const { return limit_; }
+
+  void set_limit(size_t limit) { limit_ = limit; }
+
+  /** Bytes currently reserved. */
+  size_t used() const { return used_; }
+
+  /** The highest value of `used()` so far. */
+  size_t peak() const { return peak_; }
+
+  /** How many reservations failed, because the budget was exhausted. */
+  uint64_t rejected() const { return rejected_; }
+};
+
+
+/**
+ * A pool of fixed-size buffers (e.g., for reading from sockets), allocated in slabs of
+ * several buffers at a time, and recycled once released, rather than freed.
+ *
+ * <p>Slabs are accounted for against the `MemoryBudget`, and are only freed when the pool
+ * is destroyed: a pool's memory usage is bounded by its high-water mark.
+ */
+class BufferPool {
+  MemoryBudget *budget_;
+  size_t buffer_size_;
+  size_t buffers_per_slab_;
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<char[]>> slabs_;
+  std::vector<char *> free_;
+
+  void Recycle(char *data);
+
+ public:
+  /**
+   * A buffer borrowed from the pool, returned to it when destroyed; empty (`data()` is
+   * `nullptr`) if the pool could not allocate one, within the budget.
+   */
+  class Buffer {
+    friend class BufferPool;
+
+    BufferPool *pool_ = nullptr;
+    char *data_ = nullptr;
+
+    Buffer(BufferPool *pool, char *data) : pool_(pool), data_(data) {}
+
+   public:
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer(Buffer &&other) noexcept : pool_(other.pool_), data_(other.data_) {
+      other.data_ = nullptr;
+    }
+    Buffer &operator=(Buffer &&other) noexcept;
+    ~Buffer();
+
+    char *data() const { return data_; }
+
+    size_t size() const { return data_ != nullptr ? pool_->buffer_size_ : 0; }
+
+    explicit operator bool() const { return data_ != nullptr; }
+  };
+
+  BufferPool(MemoryBudget *budget, size_t buffer_size, size_t buffers_per_slab = 16) :
+      budget_(budget), buffer_size_(buffer_size), buffers_per_slab_(buffers_per_slab) {}
+
+  BufferPool(const BufferPool &) = delete;
+
+  ~BufferPool();
+
+  Buffer Acquire();
+
+  size_t buffer_size() const { return buffer_size_; }
+
+  /** Bytes allocated by the pool, whether the buffers are in use or not. */
+  size_t allocated();
+
+  /** Buffers allocated, but not in use. */
+  size_t available();
+};
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,129 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 7/11/20.
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace api {
+namespace rest {
+
+/**
+ * An immutable value, which can be replaced at any time, while other threads keep reading
+ * it (e.g., the routes served by an `ApiServer`).
+ *
+ * <p>Readers never lock, nor contend with each other: each thread keeps its own cached
+ * reference to the value, and only checks (with an atomic load) whether it has been
+ * replaced since; if so, it takes a reference to the new one, which is the only time it
+ * locks. This is unlike `std::atomic_load()` on a `std::shared_ptr`, which (in libstdc++)
+ * takes a lock from a global pool every time.
+ *
+ * <p>Writers are expected to be rare: a replaced value is only released once every thread
+ * that read it has read it again (or exited). The values of a destroyed `Published` are
+ * dropped by each thread the next time it reads any other one (of the same type).
+ */
+template <typename T>
+class Published {
+  struct Cached {
+    uint64_t id;
+    std::weak_ptr<const void> owner;
+    uint64_t version;
+    std::shared_ptr<const T> value;
+  };
+
+  static uint64_t NextId() {
+    static std::atomic<uint64_t> next{0};
+    return ++next;
+  }
+
+  static std::vector<Cached> &Cache() {
+    thread_local std::vector<Cached> cache;
+    return cache;
+  }
+
+  /** Drops the values cached for `Published` instances which no longer exist. */
+  static void Prune(std::vector<Cached> &cache) {
+    cache.erase(std::remove_if(cache.begin(), cache.end(),
+                               [](const Cached &cached) { return cached.owner.expired(); }),
+                cache.end());
+  }
+
+  // Identifies this instance in the threads' caches (addresses may be reused).
+  const uint64_t id_;
+  const std::shared_ptr<const void> alive_;
+  std::atomic<uint64_t> version_{0};
+
+  mutable std::mutex mutex_;
+  std::shared_ptr<const T> value_;
+
+ public:
+  explicit Published(std::shared_ptr<const T> value) :
+      id_(NextId()), alive_(std::make_shared<char>()), value_(std::move(value)) {}
+
+  Published(const Published &) = delete;
+
+  /** @return the current value, which stays valid for as long as it is held */
+  std::shared_ptr<const T> get() const {
+    auto version = version_.load(std::memory_order_acquire);
+    auto &cache = Cache();
+    auto cached = Find(cache);
+    if (cached != cache.end() && cached->version == version) {
+      return cached->value;
+    }
+
+    std::shared_ptr<const T> value, replaced;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      value = value_;
+      version = version_.load(std::memory_order_relaxed);
+    }
+    if (cached != cache.end()) {
+      replaced = std::move(cached->value);
+      cached->value = value;
+      cached->version = version;
+    } else {
+      cache.push_back(Cached{id_, alive_, version, value});
+    }
+    // Releasing the replaced value may destroy other instances, whose values are dropped too.
+    replaced.reset();
+    Prune(cache);
+    return value;
+  }
+
+  /** Replaces the value: readers holding the previous one are unaffected. */
+  void set(std::shared_ptr<const T> value) {
+    std::shared_ptr<const T> replaced;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      replaced = std::move(value_);
+      value_ = std::move(value);
+      version_.fetch_add(1, std::memory_order_release);
+    }
+    // This thread's reference to the replaced value need not wait for its next read.
+    std::shared_ptr<const T> dropped;
+    auto &cache = Cache();
+    auto cached = Find(cache);
+    if (cached != cache.end()) {
+      dropped = std::move(cached->value);
+      cache.erase(cached);
+    }
+    dropped.reset();
+    replaced.reset();
+    Prune(cache);
+  }
+
+ private:
+  typename std::vector<Cached>::iterator Find(std::vector<Cached> &cache) const {
+    return std::find_if(cache.begin(), cache.end(),
+                        [this](const Cached &cached) { return cached.id == id_; });
+  }
+};
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,135 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/20/20.
+
+
+#pragma once
+
+#include <microhttpd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api/rest/MemoryBudget.hpp"
+
+namespace api {
+namespace rest {
+
+/**
+ * A response built once, and queued unchanged on every connection waiting for it: the
+ * body is copied into libmicrohttpd's buffer only once, regardless of the number of
+ * clients it is sent to.
+ *
+ * <p>Its body is accounted for in `budget` (if any), until the response is destroyed.
+ */
+struct SharedResponse {
+  unsigned int status_code = 0;
+  struct MHD_Response *response = nullptr;
+  MemoryBudget *budget = nullptr;
+  size_t reserved = 0;
+
+  SharedResponse() = default;
+  SharedResponse(const SharedResponse &) = delete;
+
+  ~SharedResponse() {
+    if (response != nullptr) {
+      MHD_destroy_response(response);
+    }
+    if (budget != nullptr) {
+      budget->Release(reserved);
+    }
+  }
+};
+
+/**
+ * Coalesces concurrent identical requests (see `ApiServer::AddCoalescedGet()`): while a
+ * call for a given key is in flight, further requests for the same key wait for its
+ * result, instead of running the handler again.
+ *
+ * <p>Connections are suspended while waiting, so that they neither block the daemon's
+ * thread, nor cost one of their own: the call runs on one of (at most) `max_workers`
+ * threads, which resumes all the waiting connections once the response is ready; calls
+ * for further keys are queued meanwhile. Workers are started as needed, and exit once
+ * there is nothing left to run.
+ *
+ * <p>Responses are not cached: a request arriving after the call completed starts a new
+ * one.
+ */
+class SingleFlight : public std::enable_shared_from_this<SingleFlight> {
+ public:
+  using Call = std::function<void(SharedResponse *)>;
+
+  struct Flight {
+    SharedResponse result;
+    std::vector<struct MHD_Connection *> waiters;
+  };
+
+  /** Default upper bound for the number of calls running at the same time. */
+  static const size_t kDefaultMaxWorkers = 4;
+
+ private:
+  struct Task {
+    std::string key;
+    std::shared_ptr<Flight> flight;
+    Call call;
+  };
+
+  size_t max_workers_;
+
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+  std::deque<Task> queue_;
+  size_t workers_ = 0;
+
+  /** Runs the queued calls, until there are none left. */
+  void Work();
+
+  void Complete(const std::string &key, const std::shared_ptr<Flight> &flight);
+
+ public:
+  explicit SingleFlight(size_t max_workers = kDefaultMaxWorkers) :
+      max_workers_(max_workers > 0 ? max_workers : 1) {}
+
+  SingleFlight(const SingleFlight &) = delete;
+
+  /**
+   * @return the key identifying requests for `resource` with the same query arguments,
+   *      regardless of the order in which they were sent
+   */
+  static std::string Key(const std::string &resource, const std::map<std::string,
+                                                                      std::string> &args);
+
+  /**
+   * Suspends `connection` until the result of the call for `key` is available: if there
+   * is none in flight, `call` is queued, to produce it.
+   *
+   * <p>`connection` may be `nullptr`, in which case the caller is expected to wait for the
+   * flight to complete (e.g., via `Drain()`).
+   *
+   * @return the flight, whose `result` can be queued once the connection is resumed;
+   *      the `response` is `nullptr` if the call failed
+   */
+  std::shared_ptr<const Flight> Join(const std::string &key,
+                                     struct MHD_Connection *connection,
+                                     Call call);
+
+  /** @return the number of calls currently in flight */
+  size_t in_flight();
+
+  /**
+   * Waits for all calls in flight to complete (and their connections to be resumed), and
+   * for the workers to release everything the calls used (e.g., handlers, and memory
+   * reserved for their results): must be called before stopping the daemon.
+   */
+  void Drain();
+};
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,253 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/30/20.
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#include "api/rest/ApiServer.hpp"
+
+namespace api {
+namespace rest {
+
+/**
+ * A route known at compile time: unlike those registered via `ApiServer::AddGet()` and
+ * friends, the handler is kept with its own type (typically, a lambda's), so that it is
+ * inlined in a per-route function, rather than called via a `std::function`.
+ */
+template <typename F>
+struct StaticRoute {
+  std::string_view method;
+  std::string_view resource;
+  F handler;
+};
+
+template <typename F>
+constexpr StaticRoute<F> StaticGet(std::string_view resource, F handler) {
+  return {"GET", resource, handler};
+}
+
+template <typename F>
+constexpr StaticRoute<F> StaticPost(std::string_view resource, F handler) {
+  return {"POST", resource, handler};
+}
+
+template <typename F>
+constexpr StaticRoute<F> StaticPut(std::string_view resource, F handler) {
+  return {"PUT", resource, handler};
+}
+
+template <typename F>
+constexpr StaticRoute<F> StaticDelete(std::string_view resource, F handler) {
+  return {"DELETE", resource, handler};
+}
+
+/**
+ * A routing table built at compile time: routes are looked up using a perfect hash of
+ * `{method, resource}`, (computed by the compiler, when the router is declared `constexpr`),
+ * so that a lookup costs one hash, two table probes and one string comparison.
+ *
+ * <p>The hash is built using "hash and displace" (CHD): routes are split into small
+ * buckets, and each bucket is assigned the displacement which places all of its routes in
+ * free slots, largest buckets first; this takes a few attempts per bucket, regardless of
+ * the number of routes.
+ *
+ * <p>Use `MakeStaticRouter()` to create one, and `ApiServer::SetCompiledRoutes()` to serve
+ * its routes:
+ *
+ * <pre>
+ *   static constexpr auto kRoutes = MakeStaticRouter(
+ *       StaticGet("status", [](const Request &request) { return Response::ok(); }),
+ *       StaticPost("entity", [](const Request &request) { ... }));
+ *
+ *   server.SetCompiledRoutes(&kRoutes);
+ * </pre>
+ *
+ * <p>Declaring the same route twice is a compilation error.
+ */
+template <typename... Fs>
+class StaticRouter final : public CompiledRoutes {
+  static_assert(sizeof...(Fs) > 0, "A StaticRouter needs at least one route");
+
+  static constexpr size_t kSize = sizeof...(Fs);
+  static constexpr uint32_t kMaxDisplacement = 1U << 16;
+
+  static constexpr size_t PowerOfTwoAtLeast(size_t size) {
+    size_t power = 1;
+    while (power < size) {
+      power <<= 1;
+    }
+    return power;
+  }
+  // A load factor of at most 1/2, with buckets of about two routes.
+  static constexpr size_t kSlots = PowerOfTwoAtLeast(2 * kSize);
+  static constexpr size_t kBuckets = PowerOfTwoAtLeast((kSize + 1) / 2);
+
+  std::tuple<Fs...> handlers_;
+  std::array<std::string_view, kSize> methods_;
+  std::array<std::string_view, kSize> resources_;
+
+  std::array<uint32_t, kBuckets> displacements_;
+  // Indexes (plus one) into the routes; zero marks an empty slot.
+  std::array<size_t, kSlots> slots_;
+
+  static constexpr size_t Bucket(uint64_t hash) {
+    return static_cast<size_t>(hash >> 32) & (kBuckets - 1);
+  }
+
+  static constexpr size_t Slot(uint64_t hash, uint32_t displacement) {
+    return static_cast<size_t>(Mix(hash + displacement * 0x9e3779b97f4a7c15ULL)) &
+        (kSlots - 1);
+  }
+
+  /**
+   * Places the first `count` routes in `members` (all in the same bucket) using
+   * `displacement`, if all of them land in distinct, free slots.
+   *
+   * @return whether the routes were placed
+   */
+  constexpr bool Place(const std::array<uint64_t, kSize> &hashes,
+                       const std::array<size_t, kSize> &members, size_t count,
+                       uint32_t displacement) {
+    for (size_t i = 0; i < count; ++i) {
+      auto slot = Slot(hashes[members[i]], displacement);
+      if (slots_[slot] != 0) {
+        for (size_t j = 0; j < i; ++j) {
+          slots_[Slot(hashes[members[j]], displacement)] = 0;
+        }
+        return false;
+      }
+      slots_[slot] = members[i] + 1;
+    }
+    return true;
+  }
+
+  using Thunk = Response (*)(const StaticRouter &, const Request &);
+
+  template <size_t I>
+  static Response Call(const StaticRouter &router, const Request &request) {
+    return std::get<I>(router.handlers_)(request);
+  }
+
+  template <size_t... I>
+  Response InvokeAt(size_t index, const Request &request, std::index_sequence<I...>) const {
+    static constexpr Thunk kThunks[] = {&Call<I>...};
+    return kThunks[index](*this, request);
+  }
+
+ public:
+  /** The finalizer of MurmurHash3, so that all the bits of `hash` are well spread. */
+  static constexpr uint64_t Mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  /** FNV-1a, mixed: the high bits pick a bucket, all of them (displaced) a slot. */
+  static constexpr uint64_t Hash(std::string_view method, std::string_view resource) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : method) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ static_cast<uint8_t>(' ')) * 0x100000001b3ULL;
+    for (char c : resource) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+    }
+    return Mix(hash);
+  }
+
+  constexpr explicit StaticRouter(StaticRoute<Fs>... routes) :
+      handlers_(routes.handler...),
+      methods_{{routes.method...}},
+      resources_{{routes.resource...}},
+      displacements_{},
+      slots_{} {
+    // Routes are only hashed once: placing them only takes integer operations.
+    std::array<uint64_t, kSize> hashes{};
+    std::array<size_t, kBuckets> bucket_sizes{};
+    size_t largest = 0;
+    for (size_t i = 0; i < kSize; ++i) {
+      for (size_t j = i + 1; j < kSize; ++j) {
+        if (methods_[i] == methods_[j] && resources_[i] == resources_[j]) {
+          throw std::logic_error("Duplicate route in StaticRouter");
+        }
+      }
+      hashes[i] = Hash(methods_[i], resources_[i]);
+      auto size = ++bucket_sizes[Bucket(hashes[i])];
+      largest = size > largest ? size : largest;
+    }
+
+    std::array<size_t, kSize> members{};
+    for (auto size = largest; size > 0; --size) {
+      for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+        if (bucket_sizes[bucket] != size) {
+          continue;
+        }
+        size_t count = 0;
+        for (size_t i = 0; i < kSize; ++i) {
+          if (Bucket(hashes[i]) == bucket) {
+            members[count++] = i;
+          }
+        }
+        uint32_t displacement = 0;
+        while (!Place(hashes, members, count, displacement)) {
+          if (++displacement == kMaxDisplacement) {
+            throw std::logic_error("Cannot build a perfect hash for the routes");
+          }
+        }
+        displacements_[bucket] = displacement;
+      }
+    }
+  }
+
+  constexpr size_t size() const { return kSize; }
+
+  int Find(const std::string &method, const std::string &resource) const override {
+    auto hash = Hash(method, resource);
+    auto slot = slots_[Slot(hash, displacements_[Bucket(hash)])];
+    if (slot == 0) {
+      return -1;
+    }
+    --slot;
+    return methods_[slot] == method && resources_[slot] == resource ?
+        static_cast<int>(slot) : -1;
+  }
+
+  Response Invoke(int index, const Request &request) const override {
+    return InvokeAt(static_cast<size_t>(index), request, std::index_sequence_for<Fs...>{});
+  }
+
+  bool HasMethod(const std::string &method) const override {
+    for (const auto &m : methods_) {
+      if (m == method) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void ForEach(const std::function<void(const std::string &, const std::string &)> &visitor)
+      const override {
+    for (size_t i = 0; i < kSize; ++i) {
+      visitor(std::string{methods_[i]}, std::string{resources_[i]});
+    }
+  }
+};
+
+template <typename... Fs>
+constexpr StaticRouter<Fs...> MakeStaticRouter(StaticRoute<Fs>... routes) {
+  return StaticRouter<Fs...>(routes...);
+}
+
+} // namespace rest
+} // namespace api
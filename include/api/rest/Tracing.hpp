@@ -0,0 +1,266 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/6/20.
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace api {
+namespace rest {
+
+/**
+ * The phases a request goes through, while being processed by `ApiServer`.
+ */
+enum class TracePhase : uint8_t {
+  kParse = 0,   // Collecting headers and query arguments.
+  kRoute,       // Looking up the handler.
+  kHandler,     // Running the handler.
+  kSerialize,   // Building the HTTP response.
+  kSend,        // Queueing the response for sending.
+  kCount
+};
+
+const char *TracePhaseName(TracePhase phase);
+
+constexpr size_t kTracePhases = static_cast<size_t>(TracePhase::kCount);
+
+/**
+ * The timings of a single (sampled) request; times are in nanoseconds since the Unix
+ * epoch, durations in nanoseconds.
+ */
+struct TraceSample {
+  uint64_t trace_id_high;
+  uint64_t trace_id_low;
+  uint64_t span_id;
+  std::string method;
+  std::string resource;
+  unsigned int status_code;
+  uint64_t thread_id;
+  uint64_t start_ns;
+  uint64_t end_ns;
+
+  // When each phase was first entered (0 if never) and the total time spent in it.
+  std::array<uint64_t, kTracePhases> phase_start_ns;
+  std::array<uint64_t, kTracePhases> phase_duration_ns;
+};
+
+/**
+ * Exports samples collected by a `Tracer`; `Export()` is always called from one thread at
+ * a time.
+ */
+class TraceExporter {
+ public:
+  virtual ~TraceExporter() = default;
+
+  virtual void Export(const std::vector<TraceSample> &samples) = 0;
+};
+
+/**
+ * Writes samples in the Chrome Trace Event format (one "complete" event per request, and
+ * one per phase), which can be loaded in `chrome://tracing` or Perfetto.
+ *
+ * <p>Uses the "JSON Array" format, which does not require the closing bracket, so that
+ * events can be appended to the file as they are exported.
+ *
+ * @see https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+ */
+class ChromeTraceExporter : public TraceExporter {
+  std::ofstream out_;
+
+ public:
+  explicit ChromeTraceExporter(const std::string &filename);
+
+  void Export(const std::vector<TraceSample> &samples) override;
+
+  /** Formats `sample` as Trace Events, each followed by a comma and a newline. */
+  static void Write(const TraceSample &sample, std::ostream &out);
+};
+
+/**
+ * Writes samples as OpenTelemetry spans, in the OTLP/JSON encoding of an
+ * `ExportTraceServiceRequest` (one per line, for each batch exported): each request is a
+ * `SERVER` span, with a child span for each phase.
+ *
+ * @see https://opentelemetry.io/docs/specs/otlp/#json-protobuf-encoding
+ */
+class OtlpJsonExporter : public TraceExporter {
+  std::ostream &out_;
+  std::string service_name_;
+
+ public:
+  OtlpJsonExporter(std::ostream &out, std::string service_name) :
+      out_(out), service_name_(std::move(service_name)) {}
+
+  void Export(const std::vector<TraceSample> &samples) override;
+
+  static void Write(const std::vector<TraceSample> &samples, const std::string &service_name,
+                    std::ostream &out);
+};
+
+
+/**
+ * Samples collected by a single thread; bounded in size, once full the oldest samples
+ * are overwritten.
+ */
+struct TraceBuffer {
+  std::mutex mutex;  // Only contended while the `Tracer` is flushing.
+  std::vector<TraceSample> samples;
+  size_t next = 0;
+  uint64_t dropped = 0;
+
+  uint64_t thread_id;
+  uint64_t counter = 0;
+  std::mt19937_64 random;
+};
+
+/**
+ * Collects the per-phase timings of a fraction of the requests processed by an
+ * `ApiServer` (see `ApiServer::set_tracer()`), and periodically hands them to a
+ * `TraceExporter`.
+ *
+ * <p>Samples are accumulated in per-thread buffers, so that recording them does not
+ * contend with other threads serving requests.
+ */
+class Tracer {
+  static std::atomic<uint64_t> next_id_;
+
+  uint64_t id_;
+  std::shared_ptr<TraceExporter> exporter_;
+  uint64_t period_;
+  size_t buffer_size_;
+
+  std::mutex buffers_mutex_;
+  std::vector<std::shared_ptr<TraceBuffer>> buffers_;
+
+  // Serializes calls to the exporter.
+  std::mutex flush_mutex_;
+
+  std::thread flusher_;
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  bool stopped_ = false;
+
+ public:
+  /**
+   * @param exporter where samples are sent, when flushed
+   * @param sampling_rate fraction of requests to sample, between 0 and 1: one out of
+   *      every `1 / sampling_rate` requests (on each thread) is traced
+   * @param flush_interval how often samples are exported by a background thread; if zero,
+   *      only when `Flush()` is called (and when the tracer is destroyed)
+   * @param buffer_size maximum number of samples kept, for each thread, between flushes
+   */
+  explicit Tracer(std::shared_ptr<TraceExporter> exporter,
+                  double sampling_rate = 1.0,
+                  std::chrono::milliseconds flush_interval = std::chrono::milliseconds{0},
+                  size_t buffer_size = 4096);
+
+  Tracer(const Tracer &) = delete;
+
+  virtual ~Tracer();
+
+  /**
+   * @return the calling thread's buffer, if the next request on this thread should be
+   *      traced; `nullptr` otherwise
+   */
+  TraceBuffer *Sample();
+
+  void Record(TraceBuffer *buffer, TraceSample &&sample);
+
+  /** Exports all the samples collected so far. */
+  void Flush();
+
+  /** Samples lost because buffers filled up before being flushed. */
+  uint64_t dropped();
+};
+
+
+/**
+ * Accumulates the time spent in each `TracePhase` by a request, possibly across several
+ * calls to `ApiServer::ConnectCallback` (e.g., for POST requests).
+ *
+ * <p>When the request is not sampled, all methods return after checking a single flag.
+ */
+class RequestTrace {
+  using Clock = std::chrono::steady_clock;
+
+  Tracer *tracer_ = nullptr;
+  TraceBuffer *buffer_ = nullptr;
+
+  Clock::time_point start_;
+  Clock::time_point entered_;
+  int current_ = -1;
+  std::array<Clock::duration, kTracePhases> durations_{};
+  std::array<Clock::time_point, kTracePhases> first_entered_{};
+
+  std::string method_;
+  std::string resource_;
+  unsigned int status_code_ = 0;
+
+  void Start(Tracer *tracer, const char *method, const std::string &resource);
+  void Record();
+
+  void Leave(Clock::time_point now) {
+    if (current_ >= 0) {
+      durations_[current_] += now - entered_;
+      current_ = -1;
+    }
+  }
+
+ public:
+  RequestTrace() = default;
+
+  /** Starts tracing the request, if `tracer` is not null and decides to sample it. */
+  void Begin(Tracer *tracer, const char *method, const std::string &resource) {
+    if (tracer != nullptr) {
+      Start(tracer, method, resource);
+    }
+  }
+
+  bool active() const { return buffer_ != nullptr; }
+
+  /** Ends the current phase (if any), and starts `phase`. */
+  void Enter(TracePhase phase) {
+    if (buffer_ != nullptr) {
+      auto now = Clock::now();
+      Leave(now);
+      auto index = static_cast<size_t>(phase);
+      if (first_entered_[index] == Clock::time_point{}) {
+        first_entered_[index] = now;
+      }
+      current_ = static_cast<int>(index);
+      entered_ = now;
+    }
+  }
+
+  /** Ends the current phase: time spent outside of any phase is not attributed. */
+  void Pause() {
+    if (buffer_ != nullptr) {
+      Leave(Clock::now());
+    }
+  }
+
+  void set_status_code(unsigned int status_code) { status_code_ = status_code; }
+
+  /** Records the sample with the `Tracer`; the trace is no longer active afterwards. */
+  void End() {
+    if (buffer_ != nullptr) {
+      Record();
+    }
+  }
+};
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,217 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/9/20.
+
+
+#pragma once
+
+#include <microhttpd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "api/rest/MemoryBudget.hpp"
+
+namespace api {
+namespace rest {
+
+/** Largest message (possibly split across several fragments) we accept from clients. */
+extern const size_t kMaxWebSocketMessageSize;
+
+/**
+ * How long a send may wait for the client to read: if it does not, the session is closed,
+ * rather than blocking the sender (and every other one) indefinitely.
+ */
+extern const std::chrono::milliseconds kWebSocketSendTimeout;
+
+enum class WebSocketOpcode : uint8_t {
+  kContinuation = 0x0,
+  kText = 0x1,
+  kBinary = 0x2,
+  kClose = 0x8,
+  kPing = 0x9,
+  kPong = 0xA
+};
+
+struct WebSocketFrame {
+  bool fin;
+  WebSocketOpcode opcode;
+  std::string payload;
+};
+
+struct WebSocketMessage {
+  std::string data;
+  bool binary;
+};
+
+/**
+ * Incremental parser for the frames sent by a WebSocket client: data can be fed as it
+ * arrives from the socket, in chunks of any size, and complete frames are returned as soon
+ * as they are available, with their payload already unmasked.
+ *
+ * @see https://tools.ietf.org/html/rfc6455#section-5.2
+ */
+class WebSocketFrameParser {
+  size_t max_payload_;
+  std::string buffer_;
+
+ public:
+  explicit WebSocketFrameParser(size_t max_payload = kMaxWebSocketMessageSize) :
+      max_payload_(max_payload) {}
+
+  /**
+   * Parses all the complete frames in the data received so far.
+   *
+   * @param data the newly received bytes
+   * @param len how many bytes in `data`
+   * @param frames where complete frames will be appended
+   * @return `false` if the client violated the protocol (e.g., sent an unmasked frame, or
+   *      a payload larger than allowed), in which case the connection should be dropped
+   */
+  bool Parse(const char *data, size_t len, std::vector<WebSocketFrame> *frames);
+};
+
+/**
+ * Applies the 4-byte `mask` to `len` bytes in `data`, in place; as XOR is its own inverse,
+ * this is used both to mask and unmask payloads.
+ *
+ * <p>Uses SSE2/AVX2 instructions, when available, to process 16/32 bytes at a time.
+ */
+void ApplyWebSocketMask(char *data, size_t len, const uint8_t mask[4]);
+
+/** Serializes an (unmasked, as sent by servers) frame carrying the whole `payload`. */
+std::string EncodeWebSocketFrame(WebSocketOpcode opcode, const std::string &payload);
+
+/** Computes the `Sec-WebSocket-Accept` header value for the client's `key`. */
+std::string WebSocketAcceptKey(const std::string &key);
+
+
+class WebSocketSession;
+using WebSocketHandler = std::function<void(WebSocketSession &, const WebSocketMessage &)>;
+
+/**
+ * Keeps track of all the active WebSocket sessions, so that they can be terminated before
+ * the HTTP daemon is stopped.
+ */
+class WebSocketRegistry {
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_set<WebSocketSession *> sessions_;
+
+  // Sessions' read buffers.
+  BufferPool buffers_;
+
+ public:
+  /** @param budget accounts for the sessions' read buffers */
+  explicit WebSocketRegistry(MemoryBudget *budget);
+
+  BufferPool &buffers() { return buffers_; }
+
+  void Add(WebSocketSession *session);
+
+  void Remove(WebSocketSession *session);
+
+  /** Disconnects every active session, and waits for all of them to terminate. */
+  void CloseAll();
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sessions_.size();
+  }
+};
+
+/**
+ * A resource that accepts WebSocket connections, as registered with
+ * `ApiServer::AddWebSocket()`.
+ */
+struct WebSocketEndpoint {
+  std::string resource;
+  WebSocketHandler handler;
+  WebSocketRegistry *registry;
+};
+
+/**
+ * A connection upgraded to the WebSocket protocol.
+ *
+ * <p>Each session runs its own thread, which reads frames from the socket and invokes the
+ * `WebSocketHandler` for every complete (text or binary) message received: pings and close
+ * frames are handled transparently.
+ *
+ * <p>Messages can be sent back at any time, from any thread, using `Send()`: handlers that
+ * need to push messages outside of the callback can keep a reference to the session via
+ * `shared_from_this()`.
+ */
+class WebSocketSession : public std::enable_shared_from_this<WebSocketSession> {
+  std::string resource_;
+  WebSocketHandler handler_;
+  WebSocketRegistry *registry_;
+  MHD_socket socket_;
+  struct MHD_UpgradeResponseHandle *urh_;
+
+  // Serializes writers, which may block while the client is not reading.
+  std::mutex write_mutex_;
+
+  // Guards handing the socket back to libmicrohttpd: never held while blocking, so that
+  // `Shutdown()` cannot wait behind a writer.
+  std::mutex state_mutex_;
+  std::atomic<bool> closed_{false};
+
+  /** Must be called holding `write_mutex_`; shuts the socket down if it times out. */
+  bool WriteAll(const std::string &data);
+
+  void Dispatch(const WebSocketMessage &message);
+
+ public:
+  WebSocketSession(std::string resource, WebSocketHandler handler, WebSocketRegistry *registry,
+                   MHD_socket socket, struct MHD_UpgradeResponseHandle *urh) :
+      resource_(std::move(resource)), handler_(std::move(handler)), registry_(registry),
+      socket_(socket), urh_(urh) {}
+
+  WebSocketSession(const WebSocketSession &) = delete;
+
+  const std::string &resource() const { return resource_; }
+
+  /**
+   * Sends a message to the client.
+   *
+   * @return `false` if the session has been closed, or the message could not be sent
+   */
+  bool Send(const std::string &data, bool binary = false);
+
+  /** Starts the closing handshake; the session will terminate once the client replies. */
+  void Close(uint16_t code = 1000);
+
+  /**
+   * Reads and dispatches messages until the client disconnects, then hands the socket back
+   * to libmicrohttpd to be closed.
+   *
+   * @param extra_in data that libmicrohttpd had already read from the socket, past the
+   *      HTTP Upgrade request
+   */
+  void Run(std::string extra_in);
+
+  /** Forces `Run()` to terminate, by shutting down the underlying socket. */
+  void Shutdown();
+
+  /**
+   * Callback for `MHD_create_response_for_upgrade()`; `cls` is the `WebSocketEndpoint`
+   * the connection was upgraded for.
+   */
+  static void UpgradeHandler(void *cls,
+                             struct MHD_Connection *connection,
+                             void *con_cls,
+                             const char *extra_in,
+                             size_t extra_in_size,
+                             MHD_socket sock,
+                             struct MHD_UpgradeResponseHandle *urh);
+};
+
+} // namespace rest
+} // namespace api
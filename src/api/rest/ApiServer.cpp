@@ -3,6 +3,14 @@
 
 
 #include <glog/logging.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include "api/rest/ApiServer.hpp"
 
@@ -14,17 +22,192 @@ const char *const kApiVersionPrefix = "/api/v1";
 const char *const kApplicationJson = "application/json";
 const char *const kTextHtml = "text/html";
 const char *const kApplicationProtobuf = "application/x-protobuf";
+const char *const kRequestTimeoutHeader = "X-Request-Timeout";
+const std::chrono::milliseconds kDefaultHeartbeatInterval{15000};
 
 // Mark: ERROR CONSTANTS
-const char *const kNoApiUrl = "Unknown API endpoint; should start with /api/v1/";
+const char *const kNoApiUrl = "Unknown API endpoint; no route group serves this path";
 const char *const kIllegalRequest = "Cannot parse JSON into valid PB";
 const char *const kInvalidResource = "Not a valid resource";
 const char *const kMethodNotAllowed = "Method Not Allowed";
+const char *const kInvalidWebSocketHandshake = "Invalid WebSocket handshake";
+const char *const kDeadlineExpired = "Request deadline expired";
+const char *const kMemoryBudgetExhausted = "Memory budget exhausted, try again later";
+const char *const kPayloadTooLarge = "Request body too large";
+const char *const kTooManyRequests = "Too many concurrent requests, try again later";
+const char *const kCoalescedCallFailed = "The request could not be served";
 
-struct post_info {
-  Response* response;
+/** Size of the buffer used by libmicrohttpd to read events from an event stream. */
+const size_t kEventStreamBlockSize = 4096;
+
+/** The memory libmicrohttpd allocates for each connection, unless configured otherwise. */
+const size_t kDefaultConnectionMemory = 32 * 1024;
+
+const char *const kSecWebSocketKey = "Sec-WebSocket-Key";
+const char *const kSecWebSocketVersion = "Sec-WebSocket-Version";
+const char *const kSecWebSocketAccept = "Sec-WebSocket-Accept";
+
+/**
+ * State kept by libmicrohttpd across the calls to `ConnectCallback` for the same request,
+ * and released by `RequestCompletedCallback`.
+ */
+struct request_context {
+  std::shared_ptr<CancellationToken> token;
+  Handler handler;
+  // For POSTs to a compiled route, which is invoked directly, rather than via `handler`.
+  int compiled_index = -1;
+  // Whether `handler` wants all the request values copied upfront.
+  bool eager_values = false;
+  std::unique_ptr<Response> response;
+  std::shared_ptr<const SingleFlight::Flight> flight;
+  RequestTrace trace;
+
+  // Bytes reserved from the memory budget, released when the request completes; of
+  // which, those for the `response`.
+  size_t reserved = 0;
+  size_t response_reserved = 0;
+
+  // Once a request is accepted, it is served by the group and routes current at that
+  // time, for all the callbacks it takes, regardless of any concurrent changes.
+  std::shared_ptr<RouteGroup> group;
+  std::shared_ptr<const RouteTable> routes;
+  std::string resource;
+
+  // Whether the request counts against the group's `max_requests`, until it completes.
+  bool admitted = false;
+
+  // Body bytes uploaded so far.
+  size_t received = 0;
+};
+
+/** Copies all of the request's headers and query arguments, for handlers using most. */
+void CopyValues(Request &request, MHD_Connection *connection, RequestTrace *trace) {
+  trace->Enter(TracePhase::kParse);
+  request.set_connection(connection, true);
+}
+
+/**
+ * Stops attributing time to any of the request's phases, when `ConnectCallback` returns.
+ */
+struct trace_scope {
+  RequestTrace &trace;
+
+  ~trace_scope() { trace.Pause(); }
 };
 
+/** Stops copying request values upfront for `{method, resource}`. */
+void EraseEagerValues(RouteTable *routes, const std::string &method,
+                      const std::string &resource) {
+  auto resources = routes->eager_values.find(method);
+  if (resources != routes->eager_values.end()) {
+    resources->second.erase(resource);
+    if (resources->second.empty()) {
+      routes->eager_values.erase(resources);
+    }
+  }
+}
+
+/** Reserves `bytes` from `budget` for the request, until it completes. */
+bool Reserve(MemoryBudget &budget, request_context *context, size_t bytes) {
+  if (!budget.Reserve(bytes)) {
+    LOG(WARNING) << "503: " << kMemoryBudgetExhausted;
+    return false;
+  }
+  context->reserved += bytes;
+  return true;
+}
+
+/**
+ * Sends `response`, if its body fits in `budget` (where it is accounted for, until the
+ * request completes); a 503 otherwise.
+ */
+int SendWithinBudget(MemoryBudget &budget, request_context *context,
+                     MHD_Connection *connection, const Response &response) {
+  if (Reserve(budget, context, response.body().size())) {
+    return ApiServer::sendResponse(connection, response, &context->trace);
+  }
+  return ApiServer::sendResponse(connection,
+                                 Response::service_unavailable(kMemoryBudgetExhausted),
+                                 &context->trace);
+}
+
+/**
+ * Like `SendWithinBudget()`, but keeps the response, to be sent later: it replaces the one
+ * kept so far (e.g., for a previous chunk of the body), whose memory is released.
+ */
+void KeepWithinBudget(MemoryBudget &budget, request_context *context,
+                      const Response &response) {
+  budget.Release(context->response_reserved);
+  context->reserved -= context->response_reserved;
+  context->response_reserved = 0;
+
+  auto size = response.body().size();
+  if (Reserve(budget, context, size)) {
+    context->response_reserved = size;
+    context->response.reset(new Response(response));
+  } else {
+    context->response.reset(new Response(Response::service_unavailable(
+        kMemoryBudgetExhausted)));
+  }
+}
+
+
+// Mark: Request
+
+int Request::ValuesCallback(void *cls, enum MHD_ValueKind kind, const char *key,
+                            const char *value) {
+  auto request = static_cast<const Request *>(cls);
+  // Arguments without a value (e.g., `?verbose`) are passed as NULL.
+  std::string val = value != nullptr ? value : "";
+  switch (kind) {
+    case MHD_GET_ARGUMENT_KIND:
+      VLOG(2) << "[URI Query Arg] " << key << " = " << val;
+      request->query_args_[key] = val;
+      break;
+    case MHD_HEADER_KIND:
+      VLOG(2) << "[Header] " << key << ": " << val;
+      request->headers_[key] = val;
+      break;
+    default:
+      LOG(ERROR) << "Unexpected kind: " << kind << " cannot process (" << key << ", " << val << ")";
+      return MHD_NO;
+  }
+  return MHD_YES;
+}
+
+void Request::Materialize() const {
+  if (connection_ == nullptr || materialized_) {
+    return;
+  }
+  materialized_ = true;
+  MHD_get_connection_values(connection_, MHD_GET_ARGUMENT_KIND,
+                            &Request::ValuesCallback, const_cast<Request *>(this));
+  MHD_get_connection_values(connection_, MHD_HEADER_KIND,
+                            &Request::ValuesCallback, const_cast<Request *>(this));
+}
+
+std::string Request::GetQueryArg(const std::string &query) const {
+  if (connection_ != nullptr) {
+    auto value = MHD_lookup_connection_value(connection_, MHD_GET_ARGUMENT_KIND, query.c_str());
+    if (value != nullptr) {
+      return value;
+    }
+  }
+  auto arg = query_args_.find(query);
+  return arg != query_args_.end() ? arg->second : "";
+}
+
+std::string Request::GetHeader(const std::string &header) const {
+  if (connection_ != nullptr) {
+    auto value = MHD_lookup_connection_value(connection_, MHD_HEADER_KIND, header.c_str());
+    if (value != nullptr) {
+      return value;
+    }
+  }
+  auto value = headers_.find(header);
+  return value != headers_.end() ? value->second : "";
+}
+
 int ApiServer::ConnectCallback(void *cls,
                                struct MHD_Connection *connection,
                                const char *url,
@@ -34,76 +217,571 @@ int ApiServer::ConnectCallback(void *cls,
                                size_t *upload_data_size,
                                void **con_cls) {
   ApiServer *server = static_cast<ApiServer *>(cls);
-  std::string path{url};
-
-  VLOG(2) << method << " " << path;
-  if (!server->HasMethod(method)) {
-    // TODO: move this out to MethodNotAllowed() method.
-    auto response = MHD_create_response_from_buffer(strlen(kMethodNotAllowed),
-                                                    (void *) kMethodNotAllowed,
-                                                    MHD_RESPMEM_PERSISTENT);
-    LOG(ERROR) << "415: Not an allowed method: " << method;
-    int ret = MHD_queue_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, response);
-    MHD_destroy_response(response);
-    return ret;
-  }
-
-  if (path.find(kApiVersionPrefix) != 0) {
-    auto response = MHD_create_response_from_buffer(strlen(kNoApiUrl),
-                                                    (void *) kNoApiUrl,
-                                                    MHD_RESPMEM_PERSISTENT);
-    LOG(ERROR) << "Not a valid API request: " << path;
-    int ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
-    MHD_destroy_response(response);
-    return ret;
-  }
-
-  std::string resource = path.substr(path.rfind('/') + 1);
-  VLOG(2) << "Resource: " << resource;
-
-  // TODO: Populate Request with whatever headers, etc. necessary
   Request request;
 
-  // Parsing the request URI query arguments & headers.
-  // This method (according to the documentation) can take a bitmask (and the enums are built to work correctly
-  // that way); however, the compiler complains because it sees an int and cannot convert to an enum.
-  // TODO: Need to figure out a way to coalesce the following two calls into one.
-  MHD_get_connection_values (connection, MHD_GET_ARGUMENT_KIND,
-                             &ApiServer::HeadersQueryargsCallback, &request);
+  auto context = static_cast<request_context *>(*con_cls);
+  if (context == nullptr) {
+    // The group and its routes are resolved only once: all the following callbacks for
+    // the same request use them, regardless of concurrent changes.
+    std::string path{url};
+    VLOG(2) << method << " " << path;
+    std::string resource;
+    auto group = server->FindRouteGroup(path, &resource);
+    if (group == nullptr) {
+      auto response = MHD_create_response_from_buffer(strlen(kNoApiUrl),
+                                                      (void *) kNoApiUrl,
+                                                      MHD_RESPMEM_PERSISTENT);
+      LOG(ERROR) << "Not a valid API request: " << path;
+      int ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+      MHD_destroy_response(response);
+      return ret;
+    }
+
+    auto routes = group->routes();
+    if (!routes->HasMethod(method)) {
+      // TODO: move this out to MethodNotAllowed() method.
+      auto response = MHD_create_response_from_buffer(strlen(kMethodNotAllowed),
+                                                      (void *) kMethodNotAllowed,
+                                                      MHD_RESPMEM_PERSISTENT);
+      LOG(ERROR) << "415: Not an allowed method: " << method;
+      int ret = MHD_queue_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, response);
+      MHD_destroy_response(response);
+      return ret;
+    }
+    VLOG(2) << "Resource: " << resource << " in group: " << group->prefix();
 
-  MHD_get_connection_values (connection, MHD_HEADER_KIND,
-                             &ApiServer::HeadersQueryargsCallback, &request);
+    auto info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+    context = new request_context{};
+    context->token = std::make_shared<CancellationToken>(
+        server->RequestDeadline(connection, server->DefaultTimeout(*routes)),
+        info != nullptr ? info->connect_fd : MHD_INVALID_SOCKET);
+    context->trace.Begin(server->tracer_.get(), method, resource);
+    context->group = group;
+    context->routes = std::move(routes);
+    context->resource = std::move(resource);
+    *con_cls = context;
 
-  if (strcmp(method, "GET") == 0) {
-    auto& handlers_map = server->handlers_["GET"];
-    if (handlers_map.find(resource) != handlers_map.end()) {
-      auto response = handlers_map[resource](request);
-      return sendResponse(connection, response);
+    // Requests rejected upfront are traced too.
+    trace_scope scope{context->trace};
+    const auto &limits = context->routes->limits;
+    if (limits.max_requests > 0) {
+      if (!group->Admit(limits.max_requests)) {
+        LOG(WARNING) << "503: " << kTooManyRequests << " for: " << group->prefix();
+        return sendResponse(connection, Response::service_unavailable(kTooManyRequests),
+                            &context->trace);
+      }
+      context->admitted = true;
     }
-  } else if (strcmp(method, "POST") == 0) {
-    auto& handlers_map = server->handlers_["POST"];
-    if (handlers_map.find(resource) != handlers_map.end()) {
-      if (*con_cls == nullptr) {
-        *con_cls = new post_info{};
+
+    // The request body is accounted for upfront, when its size is known.
+    auto length = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                              MHD_HTTP_HEADER_CONTENT_LENGTH);
+    if (length != nullptr) {
+      auto size = strtoull(length, nullptr, 10);
+      if (limits.max_body_size > 0 && size > limits.max_body_size) {
+        LOG(ERROR) << "413: " << kPayloadTooLarge << ": " << size << " bytes";
+        return sendResponse(connection, Response::payload_too_large(kPayloadTooLarge),
+                            &context->trace);
+      }
+      if (!Reserve(server->memory_budget_, context, size)) {
+        return sendResponse(connection,
+                            Response::service_unavailable(kMemoryBudgetExhausted),
+                            &context->trace);
+      }
+    }
+  }
+  request.set_cancellation_token(context->token);
+  trace_scope scope{context->trace};
+  const auto &routes = context->routes;
+  const auto &resource = context->resource;
+
+  if (context->flight != nullptr) {
+    // Resumed, once the coalesced call completed: possibly, past this request's deadline.
+    const auto &result = context->flight->result;
+    if (context->token->expired()) {
+      LOG(ERROR) << "504: " << kDeadlineExpired;
+      return sendResponse(connection, Response::gateway_timeout(kDeadlineExpired),
+                          &context->trace);
+    }
+    if (result.response == nullptr) {
+      LOG(ERROR) << "500: " << kCoalescedCallFailed << " for: " << resource;
+      return sendResponse(connection, Response::server_error(kCoalescedCallFailed),
+                          &context->trace);
+    }
+    context->trace.Enter(TracePhase::kSend);
+    context->trace.set_status_code(result.status_code);
+    return MHD_queue_response(connection, result.status_code, result.response);
+  }
+  context->trace.Enter(TracePhase::kParse);
+
+  // Headers and query arguments are looked up by the `Request` itself, when used, unless
+  // the handler asks for them upfront (see below).
+  request.set_connection(connection);
+
+  context->trace.Enter(TracePhase::kRoute);
+
+  if (routes->compiled != nullptr && context->compiled_index < 0) {
+    auto compiled = routes->compiled;
+    auto index = compiled->Find(method, resource);
+    if (index >= 0) {
+      if (strcmp(method, "POST") == 0) {
+        context->compiled_index = index;
         return MHD_YES;
       }
+      auto invoke = [compiled, index](const Request &req) { return compiled->Invoke(index, req); };
+      return SendWithinBudget(server->memory_budget_, context, connection,
+                              InvokeHandler(invoke, request, *routes, &context->trace));
+    }
+  }
 
-      auto con_info = static_cast<post_info *>(*con_cls);
+  if (strcmp(method, "GET") == 0) {
+    auto handler = routes->FindHandler("GET", resource);
+    if (handler != nullptr) {
+      auto flights = routes->coalesced.find(resource);
+      if (flights != routes->coalesced.end()) {
+        context->flight = CoalesceRequest(connection, *flights->second, *handler, request,
+                                          resource, routes, server->DefaultTimeout(*routes),
+                                          &server->memory_budget_);
+        return MHD_YES;
+      }
+      if (routes->EagerValues("GET", resource)) {
+        CopyValues(request, connection, &context->trace);
+      }
+      return SendWithinBudget(server->memory_budget_, context, connection,
+                              InvokeHandler(*handler, request, *routes, &context->trace));
+    }
+    auto stream = routes->streams.find(resource);
+    if (stream != routes->streams.end()) {
+      return SubscribeToStream(connection, *stream->second);
+    }
+    auto websocket = routes->websockets.find(resource);
+    if (websocket != routes->websockets.end()) {
+      return UpgradeToWebSocket(connection, *websocket->second);
+    }
+  } else if (strcmp(method, "POST") == 0) {
+    if (context->handler || context->compiled_index >= 0) {
+      auto invoke = [context](const Request &req) {
+        return context->compiled_index >= 0 ?
+            context->routes->compiled->Invoke(context->compiled_index, req) :
+            context->handler(req);
+      };
+      if (context->eager_values) {
+        CopyValues(request, connection, &context->trace);
+      }
       if (*upload_data_size != 0) {
 
         VLOG(2) << "Received " << *upload_data_size << " bytes";
+        // Also enforced here, for chunked uploads (which carry no Content-Length).
+        context->received += *upload_data_size;
+        auto max_body_size = routes->limits.max_body_size;
+        if (max_body_size > 0 && context->received > max_body_size) {
+          // The rest of the body is discarded, and the 413 sent once it is all received.
+          if (context->received - *upload_data_size <= max_body_size) {
+            LOG(ERROR) << "413: " << kPayloadTooLarge << " for: " << resource;
+            KeepWithinBudget(server->memory_budget_, context,
+                             Response::payload_too_large(kPayloadTooLarge));
+          }
+          *upload_data_size = 0;
+          return MHD_YES;
+        }
         request.set_body(std::string{upload_data, *upload_data_size});
 
-        con_info->response = new Response(handlers_map[resource](request));
+        KeepWithinBudget(server->memory_budget_, context,
+                         InvokeHandler(invoke, request, *routes, &context->trace));
         *upload_data_size = 0;
         return MHD_YES;
       }
-      return sendResponse(connection, *con_info->response);
+      if (!context->response) {
+        KeepWithinBudget(server->memory_budget_, context,
+                         InvokeHandler(invoke, request, *routes, &context->trace));
+      }
+      return sendResponse(connection, *context->response, &context->trace);
+    }
+
+    // The handler is looked up only once, when the request first arrives, so that the
+    // request will complete, even if the route is removed while the body is uploaded.
+    auto handler = routes->FindHandler("POST", resource);
+    if (handler != nullptr) {
+      context->handler = *handler;
+      context->eager_values = routes->EagerValues("POST", resource);
+      return MHD_YES;
     }
   }
+  context->trace.set_status_code(MHD_HTTP_NOT_FOUND);
   return ResourceNotFound(connection, resource);
 }
 
+ApiServer::ApiServer(unsigned int port) :
+    port_(port), httpd_(nullptr), websocket_sessions_(&memory_budget_),
+    default_group_(std::make_shared<RouteGroup>(kApiVersionPrefix, &websocket_sessions_,
+                                                &memory_budget_)) {
+  groups_.set(std::make_shared<const RouteGroups>(
+      RouteGroups{{default_group_->prefix(), default_group_}}));
+}
+
+void ApiServer::Start() {
+  LOG(INFO) << "Starting HTTP API Server on " << address();
+
+  std::vector<MHD_OptionItem> options;
+  if (connection_limit_ > 0) {
+    options.push_back({MHD_OPTION_CONNECTION_LIMIT, connection_limit_, nullptr});
+  }
+  if (!unix_socket_.empty() && listen_socket_ != MHD_INVALID_SOCKET) {
+    LOG(WARNING) << "Listening on " << unix_socket_ << ", closing socket fd " << listen_socket_;
+    close(listen_socket_);
+    listen_socket_ = MHD_INVALID_SOCKET;
+  }
+  auto listen_socket = unix_socket_.empty() ? listen_socket_ : BindUnixSocket();
+  if (listen_socket != MHD_INVALID_SOCKET) {
+    options.push_back({MHD_OPTION_LISTEN_SOCKET, listen_socket, nullptr});
+  }
+  if (connection_memory_limit_ > 0) {
+    options.push_back({MHD_OPTION_CONNECTION_MEMORY_LIMIT,
+                       static_cast<intptr_t>(connection_memory_limit_), nullptr});
+  }
+  options.push_back({MHD_OPTION_NOTIFY_COMPLETED,
+                     reinterpret_cast<intptr_t>(&ApiServer::RequestCompletedCallback),
+                     this});
+  options.push_back({MHD_OPTION_NOTIFY_CONNECTION,
+                     reinterpret_cast<intptr_t>(&ApiServer::ConnectionNotifyCallback),
+                     this});
+  options.push_back({MHD_OPTION_END, 0, nullptr});
+
+  unsigned int flags = MHD_ALLOW_SUSPEND_RESUME | MHD_ALLOW_UPGRADE;
+  if (!external_event_loop_) {
+    flags |= MHD_USE_AUTO_INTERNAL_THREAD;
+  } else {
+#ifdef __linux__
+    // A single file descriptor, which the caller can add to its own epoll set.
+    flags |= MHD_USE_EPOLL;
+#endif
+  }
+
+  httpd_ = MHD_start_daemon(flags,
+                            listen_socket == MHD_INVALID_SOCKET ? port_ : 0,
+                            &ApiServer::AcceptPolicyCallback,
+                            (void *) this,
+                            ApiServer::ConnectCallback,
+                            (void *) this,       // The GFD as the extra arguments.
+                            MHD_OPTION_ARRAY, options.data(),
+                            MHD_OPTION_END);
+
+  if (httpd_ == nullptr) {
+    LOG(ERROR) << "HTTPD Daemon could not be started";
+    // The server owns the socket, whether bound here or handed over.
+    if (listen_socket != MHD_INVALID_SOCKET) {
+      close(listen_socket);
+      listen_socket_ = MHD_INVALID_SOCKET;
+    }
+    throw HttpCannotStartError();
+  }
+  for (const auto &group : *groups_.get()) {
+    LOG(INFO) << "API available at " << address() << group.first << "/*";
+  }
+  LOG_IF(INFO, external_event_loop_) << "Server driven by an external event loop";
+
+  if (heartbeat_interval_.count() > 0) {
+    heartbeat_ = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(heartbeat_mutex_);
+      while (!heartbeat_cv_.wait_for(lock, heartbeat_interval_, [this] { return stopped_; })) {
+        lock.unlock();
+        SendHeartbeats();
+        lock.lock();
+      }
+    });
+  }
+}
+
+void ApiServer::SendHeartbeats() {
+  for (const auto &group : *groups_.get()) {
+    for (const auto &stream : group.second->routes()->streams) {
+      VLOG(2) << "Heartbeat sent to " << stream.second->Heartbeat() << " subscribers of "
+              << stream.first;
+    }
+  }
+}
+
+void ApiServer::RunOnce() {
+  if (MHD_run(httpd_) != MHD_YES) {
+    LOG(ERROR) << "Could not process the server's events";
+  }
+}
+
+int ApiServer::epoll_fd() const {
+#ifdef __linux__
+  if (external_event_loop_ && httpd_ != nullptr) {
+    auto info = MHD_get_daemon_info(httpd_, MHD_DAEMON_INFO_EPOLL_FD);
+    if (info != nullptr) {
+      return info->epoll_fd;
+    }
+  }
+#endif
+  return -1;
+}
+
+bool ApiServer::GetFdSet(fd_set *read_fds, fd_set *write_fds, fd_set *except_fds,
+                         MHD_socket *max_fd) const {
+  return MHD_get_fdset(httpd_, read_fds, write_fds, except_fds, max_fd) == MHD_YES;
+}
+
+long ApiServer::NextTimeout() const {
+  MHD_UNSIGNED_LONG_LONG timeout;
+  if (MHD_get_timeout(httpd_, &timeout) != MHD_YES) {
+    return -1;
+  }
+  return static_cast<long>(timeout);
+}
+
+ApiServer::~ApiServer() {
+  LOG(INFO) << "Stopping HTTP API Server";
+
+  {
+    std::lock_guard<std::mutex> lock(heartbeat_mutex_);
+    stopped_ = true;
+  }
+  heartbeat_cv_.notify_all();
+  if (heartbeat_.joinable()) {
+    heartbeat_.join();
+  }
+
+  std::vector<std::shared_ptr<RouteGroup>> groups;
+  {
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    for (const auto &removed : removed_groups_) {
+      if (auto group = removed.lock()) {
+        groups.push_back(group);
+      }
+    }
+    for (const auto &group : *groups_.get()) {
+      groups.push_back(group.second);
+    }
+  }
+
+  // Suspended connections must be resumed before stopping the daemon.
+  for (auto &group : groups) {
+    group->CloseStreams();
+  }
+  // Similarly, upgraded connections must all be closed, and coalesced requests resumed.
+  websocket_sessions_.CloseAll();
+  for (auto &group : groups) {
+    group->DrainFlights();
+  }
+  if (httpd_ == nullptr && listen_socket_ != MHD_INVALID_SOCKET) {
+    // Handed over, but never started.
+    close(listen_socket_);
+  }
+  if (httpd_ != nullptr) {
+    // This also closes the listening socket.
+    MHD_stop_daemon(httpd_);
+    if (!unix_socket_.empty() && unix_socket_[0] != '@') {
+      unlink(unix_socket_.c_str());
+    }
+  }
+}
+
+MHD_socket ApiServer::BindUnixSocket() const {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (unix_socket_.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "Unix socket path too long: " << unix_socket_;
+    throw HttpCannotStartError();
+  }
+  memcpy(addr.sun_path, unix_socket_.data(), unix_socket_.size());
+  auto len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + unix_socket_.size());
+
+  if (unix_socket_[0] == '@') {
+#ifdef __linux__
+    addr.sun_path[0] = '\0';
+#else
+    LOG(ERROR) << "Abstract Unix sockets are only supported on Linux: " << unix_socket_;
+    throw HttpCannotStartError();
+#endif
+  } else {
+    ++len;    // The terminating NUL.
+
+    // Only remove stale sockets: a typo should not delete some other file, nor should we
+    // take over the address of a server still listening on it.
+    struct stat info{};
+    if (stat(unix_socket_.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+      auto probe = socket(AF_UNIX, SOCK_STREAM, 0);
+      auto live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&addr), len) == 0;
+      if (probe >= 0) {
+        close(probe);
+      }
+      if (live) {
+        LOG(ERROR) << "Another server is listening on Unix socket " << unix_socket_;
+        throw HttpCannotStartError();
+      }
+      unlink(unix_socket_.c_str());
+    }
+  }
+
+  auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot create Unix socket";
+    throw HttpCannotStartError();
+  }
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), len) != 0 || listen(fd, SOMAXCONN) != 0) {
+    PLOG(ERROR) << "Cannot listen on Unix socket " << unix_socket_;
+    close(fd);
+    throw HttpCannotStartError();
+  }
+  return fd;
+}
+
+std::string ApiServer::address() const {
+  if (!unix_socket_.empty()) {
+    return "unix:" + unix_socket_;
+  }
+  if (listen_socket_ != MHD_INVALID_SOCKET) {
+    return "socket fd " + std::to_string(listen_socket_);
+  }
+  return "http://localhost:" + std::to_string(port_);
+}
+
+void ApiServer::RequestCompletedCallback(void *cls,
+                                         struct MHD_Connection *connection,
+                                         void **con_cls,
+                                         enum MHD_RequestTerminationCode toe) {
+  auto context = static_cast<request_context *>(*con_cls);
+  if (context == nullptr) {
+    return;
+  }
+  context->token->Detach();
+  context->trace.End();
+  if (toe != MHD_REQUEST_TERMINATED_COMPLETED_OK) {
+    VLOG(2) << "Request terminated before completion (" << toe << "), cancelling";
+    context->token->Cancel();
+  }
+  static_cast<ApiServer *>(cls)->memory_budget_.Release(context->reserved);
+  if (context->admitted) {
+    context->group->Leave();
+  }
+  delete context;
+  *con_cls = nullptr;
+}
+
+int ApiServer::AcceptPolicyCallback(void *cls, const struct sockaddr *addr, socklen_t addrlen) {
+  auto server = static_cast<ApiServer *>(cls);
+  if (!server->memory_budget_.Fits(server->ConnectionMemory())) {
+    LOG(WARNING) << "Refusing connection: " << kMemoryBudgetExhausted;
+    return MHD_NO;
+  }
+  return MHD_YES;
+}
+
+void ApiServer::ConnectionNotifyCallback(void *cls,
+                                         struct MHD_Connection *connection,
+                                         void **socket_context,
+                                         enum MHD_ConnectionNotificationCode toe) {
+  auto server = static_cast<ApiServer *>(cls);
+  // The buffers are allocated by libmicrohttpd regardless: we can only account for them.
+  if (toe == MHD_CONNECTION_NOTIFY_STARTED) {
+    server->memory_budget_.ForceReserve(server->ConnectionMemory());
+  } else if (toe == MHD_CONNECTION_NOTIFY_CLOSED) {
+    server->memory_budget_.Release(server->ConnectionMemory());
+  }
+}
+
+size_t ApiServer::ConnectionMemory() const {
+  return connection_memory_limit_ > 0 ? connection_memory_limit_ : kDefaultConnectionMemory;
+}
+
+std::chrono::milliseconds ApiServer::DefaultTimeout(const RouteTable &routes) const {
+  return routes.limits.request_timeout.count() > 0 ? routes.limits.request_timeout :
+      request_timeout_;
+}
+
+std::chrono::steady_clock::time_point ApiServer::RequestDeadline(
+    MHD_Connection *connection, std::chrono::milliseconds timeout) const {
+  auto header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                            kRequestTimeoutHeader);
+  if (header != nullptr) {
+    char *end = nullptr;
+    auto msec = strtoul(header, &end, 10);
+    if (end != header && *end == '\0') {
+      std::chrono::milliseconds requested(msec);
+      if (timeout.count() == 0 || requested < timeout) {
+        timeout = requested;
+      }
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kRequestTimeoutHeader << ": " << header;
+    }
+  }
+
+  if (timeout.count() == 0) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  return std::chrono::steady_clock::now() + timeout;
+}
+
+template <typename F>
+Response ApiServer::InvokeHandler(const F &handler, const Request &request,
+                                  const RouteTable &routes, RequestTrace *trace) {
+  if (trace != nullptr) {
+    trace->Enter(TracePhase::kHandler);
+  }
+  auto &token = request.cancellation_token();
+  if (!token->expired()) {
+    auto response = routes.Invoke(handler, request);
+    if (!token->expired()) {
+      return response;
+    }
+  }
+  LOG(ERROR) << "504: " << kDeadlineExpired;
+  return Response::gateway_timeout(kDeadlineExpired);
+}
+
+int ApiServer::SubscribeToStream(MHD_Connection *connection, EventBroadcaster &broadcaster) {
+  auto accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                            MHD_HTTP_HEADER_ACCEPT);
+  bool long_poll = accept == nullptr || strstr(accept, kTextEventStream) == nullptr;
+
+  // The subscriber is owned by the broadcaster, and removed from it when libmicrohttpd is
+  // done with the response (see `EventSubscriber::ContentReaderFreeCallback`).
+  auto subscriber = broadcaster.Subscribe(connection, long_poll);
+  VLOG(2) << "New " << (long_poll ? "long-poll" : "SSE") << " subscriber for "
+          << broadcaster.resource();
+
+  auto res = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
+                                               kEventStreamBlockSize,
+                                               &EventSubscriber::ContentReaderCallback,
+                                               subscriber.get(),
+                                               &EventSubscriber::ContentReaderFreeCallback);
+  MHD_add_response_header(res, MHD_HTTP_HEADER_CONTENT_TYPE, kTextEventStream);
+  MHD_add_response_header(res, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+
+  auto ret = MHD_queue_response(connection, MHD_HTTP_OK, res);
+  MHD_destroy_response(res);
+  return ret;
+}
+
+int ApiServer::UpgradeToWebSocket(MHD_Connection *connection, WebSocketEndpoint &endpoint) {
+  auto upgrade = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                             MHD_HTTP_HEADER_UPGRADE);
+  auto key = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, kSecWebSocketKey);
+  auto version = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                             kSecWebSocketVersion);
+
+  std::string protocol{upgrade != nullptr ? upgrade : ""};
+  std::transform(protocol.begin(), protocol.end(), protocol.begin(), ::tolower);
+  if (protocol != "websocket" || key == nullptr || version == nullptr ||
+      strcmp(version, "13") != 0) {
+    LOG(ERROR) << "400: " << kInvalidWebSocketHandshake << " for: " << endpoint.resource;
+    return sendResponse(connection, Response::bad_request(kInvalidWebSocketHandshake));
+  }
+
+  // The request's `RouteTable` keeps `endpoint` alive until the upgrade completes, even if it
+  // is removed meanwhile: the session then only uses its own copy of the handler.
+  auto res = MHD_create_response_for_upgrade(&WebSocketSession::UpgradeHandler, &endpoint);
+  MHD_add_response_header(res, MHD_HTTP_HEADER_UPGRADE, "websocket");
+  MHD_add_response_header(res, kSecWebSocketAccept, WebSocketAcceptKey(key).c_str());
+
+  auto ret = MHD_queue_response(connection, MHD_HTTP_SWITCHING_PROTOCOLS, res);
+  MHD_destroy_response(res);
+  return ret;
+}
+
 int ApiServer::ResourceNotFound(MHD_Connection *connection, const std::string &resource) {
   auto response = MHD_create_response_from_buffer(strlen(kInvalidResource),
                                                   (void *) kInvalidResource,
@@ -114,7 +792,22 @@ int ApiServer::ResourceNotFound(MHD_Connection *connection, const std::string &r
   return ret;
 }
 
-int ApiServer::sendResponse(MHD_Connection *connection, const Response &response) {
+int ApiServer::sendResponse(MHD_Connection *connection, const Response &response,
+                            RequestTrace *trace) {
+  if (trace != nullptr) {
+    trace->Enter(TracePhase::kSerialize);
+    trace->set_status_code(response.status_code());
+  }
+  auto res = CreateResponse(response);
+  if (trace != nullptr) {
+    trace->Enter(TracePhase::kSend);
+  }
+  auto ret = MHD_queue_response(connection, response.status_code(), res);
+  MHD_destroy_response(res);
+  return ret;
+}
+
+MHD_Response *ApiServer::CreateResponse(const Response &response) {
   auto response_body = response.body();
   auto res = MHD_create_response_from_buffer(response_body.size(),
                                              (void *) response_body.c_str(),
@@ -129,38 +822,334 @@ int ApiServer::sendResponse(MHD_Connection *connection, const Response &response
   if (response.headers().count(MHD_HTTP_HEADER_CONTENT_TYPE) == 0) {
     MHD_add_response_header(res, MHD_HTTP_HEADER_CONTENT_TYPE, kApplicationJson);
   }
+  return res;
+}
 
-  auto ret = MHD_queue_response(connection, response.status_code(), res);
-  MHD_destroy_response(res);
-  return ret;
+std::shared_ptr<const SingleFlight::Flight> ApiServer::CoalesceRequest(
+    MHD_Connection *connection, SingleFlight &flights, const Handler &handler,
+    const Request &request, const std::string &resource,
+    std::shared_ptr<const RouteTable> routes, std::chrono::milliseconds timeout,
+    MemoryBudget *budget) {
+  const auto &args = request.query_args();
+  auto key = SingleFlight::Key(resource, args);
+
+  // The call may outlive this `request` (and will serve others too): it gets its own copy
+  // of the values, and a deadline of its own.
+  return flights.Join(key, connection, [=](SharedResponse *result) {
+    Request call;
+    for (const auto &arg : args) {
+      call.AddQueryArg(arg.first, arg.second);
+    }
+    auto deadline = timeout.count() > 0 ? std::chrono::steady_clock::now() + timeout :
+        std::chrono::steady_clock::time_point::max();
+    call.set_cancellation_token(std::make_shared<CancellationToken>(deadline));
+    auto response = InvokeHandler(handler, call, *routes, nullptr);
+
+    // The body is kept (once, for all the waiters) until the last of them is done with it.
+    auto size = response.body().size();
+    if (budget->Reserve(size)) {
+      result->budget = budget;
+      result->reserved = size;
+      result->status_code = response.status_code();
+      result->response = CreateResponse(response);
+    } else {
+      LOG(WARNING) << "503: " << kMemoryBudgetExhausted;
+      auto unavailable = Response::service_unavailable(kMemoryBudgetExhausted);
+      result->status_code = unavailable.status_code();
+      result->response = CreateResponse(unavailable);
+    }
+  });
 }
 
 
-void ApiServer::AddMethodHandler(const std::string &method,
+std::shared_ptr<RouteGroup> ApiServer::FindRouteGroup(const std::string &path,
+                                                      std::string *resource) const {
+  auto slash = path.rfind('/');
+  if (slash == std::string::npos) {
+    return nullptr;
+  }
+  *resource = path.substr(slash + 1);
+
+  auto groups = groups_.get();
+  std::string prefix;
+  while (true) {
+    prefix.assign(path, 0, slash);
+    auto group = groups->find(prefix);
+    if (group != groups->end()) {
+      return group->second;
+    }
+    if (slash == 0) {
+      return nullptr;
+    }
+    slash = path.rfind('/', slash - 1);
+  }
+}
+
+std::shared_ptr<RouteGroup> ApiServer::AddRouteGroup(std::string prefix) {
+  while (!prefix.empty() && prefix.back() == '/') {
+    prefix.pop_back();
+  }
+  if (!prefix.empty() && prefix.front() != '/') {
+    prefix.insert(0, 1, '/');
+  }
+
+  std::lock_guard<std::mutex> lock(groups_mutex_);
+  auto groups = groups_.get();
+  auto group = groups->find(prefix);
+  if (group != groups->end()) {
+    return group->second;
+  }
+  LOG(INFO) << "Registering route group: " << prefix;
+  auto added = std::make_shared<RouteGroup>(prefix, &websocket_sessions_, &memory_budget_);
+  auto updated = std::make_shared<RouteGroups>(*groups);
+  updated->emplace(prefix, added);
+  groups_.set(std::move(updated));
+  return added;
+}
+
+bool ApiServer::RemoveRouteGroup(const std::string &prefix) {
+  if (prefix == default_group_->prefix()) {
+    LOG(ERROR) << "The default route group cannot be removed";
+    return false;
+  }
+  std::shared_ptr<RouteGroup> removed;
+  {
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    auto groups = groups_.get();
+    auto group = groups->find(prefix);
+    if (group == groups->end()) {
+      return false;
+    }
+    removed = group->second;
+    removed_groups_.erase(std::remove_if(removed_groups_.begin(), removed_groups_.end(),
+                                         [](const std::weak_ptr<RouteGroup> &group) {
+                                           return group.expired();
+                                         }),
+                          removed_groups_.end());
+    removed_groups_.push_back(removed);
+    auto updated = std::make_shared<RouteGroups>(*groups);
+    updated->erase(prefix);
+    groups_.set(std::move(updated));
+  }
+  LOG(INFO) << "Removed route group: " << prefix;
+  removed->CloseStreams();
+  return true;
+}
+
+std::ostream &ApiServer::ListAllHandlers(std::ostream &out) const {
+  auto groups = groups_.get();
+  out << "====\nAll handlers for server on: " << address() << "\n====\n";
+  for (const auto &group : *groups) {
+    group.second->ListAllHandlers(out);
+  }
+  out << "=====\n";
+  return out;
+}
+
+
+// Mark: RouteGroup
+
+bool RouteGroup::Admit(unsigned int limit) {
+  auto active = active_.load();
+  do {
+    if (active >= limit) {
+      return false;
+    }
+  } while (!active_.compare_exchange_weak(active, active + 1));
+  return true;
+}
+
+void RouteGroup::CloseStreams() {
+  for (auto &stream : router_.routes()->streams) {
+    stream.second->Close();
+  }
+}
+
+void RouteGroup::DrainFlights() {
+  for (auto &flights : router_.routes()->coalesced) {
+    flights.second->Drain();
+  }
+  std::vector<std::shared_ptr<SingleFlight>> removed;
+  {
+    std::lock_guard<std::mutex> lock(removed_flights_mutex_);
+    for (const auto &flights : removed_flights_) {
+      if (auto live = flights.lock()) {
+        removed.push_back(std::move(live));
+      }
+    }
+  }
+  for (auto &flights : removed) {
+    flights->Drain();
+  }
+}
+
+void RouteGroup::RemovedFlights(std::shared_ptr<SingleFlight> flights) {
+  std::lock_guard<std::mutex> lock(removed_flights_mutex_);
+  removed_flights_.erase(std::remove_if(removed_flights_.begin(), removed_flights_.end(),
+                                        [](const std::weak_ptr<SingleFlight> &flights) {
+                                          return flights.expired();
+                                        }),
+                         removed_flights_.end());
+  removed_flights_.push_back(std::move(flights));
+}
+
+void RouteGroup::Use(const Middleware &middleware) {
+  router_.Update([&middleware](RouteTable *routes) {
+    routes->middleware.push_back(middleware);
+  });
+}
+
+void RouteGroup::set_limits(const RouteLimits &limits) {
+  router_.Update([&limits](RouteTable *routes) {
+    routes->limits = limits;
+  });
+}
+
+std::ostream &RouteGroup::ListAllHandlers(std::ostream &out) const {
+  auto routes = router_.routes();
+  out << "Group: " << prefix_ << std::endl;
+  for (const auto& methodHandlers : routes->handlers) {
+    out << "Method: " << methodHandlers.first << std::endl;
+    for (const auto& handler : methodHandlers.second) {
+      out << "\t" << handler.first << std::endl;
+    }
+    out << "--\n";
+  }
+  if (routes->compiled != nullptr) {
+    routes->compiled->ForEach([&out](const std::string &method, const std::string &resource) {
+      out << "Compiled: " << method << " " << resource << std::endl;
+    });
+  }
+  for (const auto& stream : routes->streams) {
+    out << "Event Stream: " << stream.first << std::endl;
+  }
+  for (const auto& websocket : routes->websockets) {
+    out << "WebSocket: " << websocket.first << std::endl;
+  }
+  return out;
+}
+
+void RouteGroup::AddMethodHandler(const std::string &method,
                                  const std::string &resource,
-                                 const Handler &handler) {
+                                 const Handler &handler,
+                                 bool eager_values) {
 
-  LOG(INFO) << "Registering " << method << " handler for: " << resource;
-  handlers_[method][resource] = handler;
+  LOG(INFO) << "Registering " << method << " handler for: " << prefix_ << "/" << resource;
+  std::shared_ptr<SingleFlight> removed;
+  router_.Update([&](RouteTable *routes) {
+    routes->handlers[method][resource] = handler;
+    if (eager_values) {
+      routes->eager_values[method].insert(resource);
+    } else {
+      EraseEagerValues(routes, method, resource);
+    }
+    auto flights = routes->coalesced.find(resource);
+    if (method == "GET" && flights != routes->coalesced.end()) {
+      removed = flights->second;
+      routes->coalesced.erase(flights);
+    }
+  });
+  if (removed) {
+    RemovedFlights(std::move(removed));
+  }
 }
 
-int ApiServer::HeadersQueryargsCallback(void *req, enum MHD_ValueKind kind, const char *key, const char *value) {
+void RouteGroup::AddCoalescedGet(const std::string &resource, const Handler &handler) {
+  LOG(INFO) << "Registering coalesced GET handler for: " << resource;
+  router_.Update([&](RouteTable *routes) {
+    routes->handlers["GET"][resource] = handler;
+    // Coalesced calls only see the query arguments, which are always copied.
+    EraseEagerValues(routes, "GET", resource);
+    if (routes->coalesced.count(resource) == 0) {
+      routes->coalesced[resource] = std::make_shared<SingleFlight>();
+    }
+  });
+}
 
-  auto request = static_cast<Request *>(req);
-  switch (kind) {
-    case MHD_GET_ARGUMENT_KIND:
-      VLOG(2) << "[URI Query Arg] " << key << " = " << value;
-      request->AddQueryArg(key, value);
-      break;
-    case MHD_HEADER_KIND:
-      VLOG(2) << "[Header] " << key << ": " << value;
-      request->AddHeader(key, value);
-      break;
-    default:
-      LOG(ERROR) << "Unexpected kind: " << kind << " cannot process (" << key << ", " << value << ")";
-      return MHD_NO;
+void RouteGroup::SetCompiledRoutes(const CompiledRoutes *routes) {
+  LOG(INFO) << "Setting compiled routes";
+  router_.Update([routes](RouteTable *table) {
+    table->compiled = routes;
+  });
+}
+
+bool RouteGroup::RemoveMethodHandler(const std::string &method, const std::string &resource) {
+  bool removed = false;
+  std::shared_ptr<SingleFlight> removed_flights;
+  router_.Update([&](RouteTable *routes) {
+    auto method_handlers = routes->handlers.find(method);
+    if (method_handlers != routes->handlers.end()) {
+      removed = method_handlers->second.erase(resource) > 0;
+      if (method_handlers->second.empty()) {
+        routes->handlers.erase(method_handlers);
+      }
+    }
+    EraseEagerValues(routes, method, resource);
+    auto flights = routes->coalesced.find(resource);
+    if (method == "GET" && flights != routes->coalesced.end()) {
+      removed_flights = flights->second;
+      routes->coalesced.erase(flights);
+    }
+  });
+  if (removed_flights) {
+    RemovedFlights(std::move(removed_flights));
   }
-  return MHD_YES;
+  LOG_IF(INFO, removed) << "Removed " << method << " handler for: " << resource;
+  return removed;
+}
+
+std::shared_ptr<EventBroadcaster> RouteGroup::AddEventStream(const std::string &resource) {
+  std::shared_ptr<EventBroadcaster> broadcaster;
+  router_.Update([&](RouteTable *routes) {
+    // Subscribers keep a reference to their broadcaster, so we never replace an existing one.
+    auto stream = routes->streams.find(resource);
+    if (stream != routes->streams.end()) {
+      broadcaster = stream->second;
+      return;
+    }
+    LOG(INFO) << "Registering event stream for: " << resource;
+    broadcaster = std::make_shared<EventBroadcaster>(resource, budget_);
+    routes->streams[resource] = broadcaster;
+  });
+  return broadcaster;
+}
+
+bool RouteGroup::RemoveEventStream(const std::string &resource) {
+  std::shared_ptr<EventBroadcaster> broadcaster;
+  router_.Update([&](RouteTable *routes) {
+    auto stream = routes->streams.find(resource);
+    if (stream != routes->streams.end()) {
+      broadcaster = stream->second;
+      routes->streams.erase(stream);
+    }
+  });
+  if (broadcaster) {
+    LOG(INFO) << "Removed event stream for: " << resource;
+    broadcaster->Close();
+  }
+  return broadcaster != nullptr;
+}
+
+void RouteGroup::AddWebSocket(const std::string &resource, const WebSocketHandler &handler) {
+  LOG(INFO) << "Registering WebSocket handler for: " << resource;
+  auto endpoint = std::make_shared<WebSocketEndpoint>(
+      WebSocketEndpoint{resource, handler, websocket_sessions_});
+  router_.Update([&](RouteTable *routes) {
+    routes->websockets[resource] = endpoint;
+  });
+}
+
+bool RouteGroup::RemoveWebSocket(const std::string &resource) {
+  bool removed = false;
+  router_.Update([&](RouteTable *routes) {
+    auto websocket = routes->websockets.find(resource);
+    if (websocket != routes->websockets.end()) {
+      routes->websockets.erase(websocket);
+      removed = true;
+    }
+  });
+  LOG_IF(INFO, removed) << "Removed WebSocket handler for: " << resource;
+  return removed;
 }
 
 } // namespace rest
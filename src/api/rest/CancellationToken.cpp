@@ -0,0 +1,95 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/23/20.
+
+
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <glog/logging.h>
+
+#include "api/rest/CancellationToken.hpp"
+
+namespace api {
+namespace rest {
+
+bool CancellationToken::PeerClosed() const {
+  MHD_socket socket = socket_;
+  if (socket == MHD_INVALID_SOCKET) {
+    return false;
+  }
+  // Over TCP, a client closing the connection only shows up as the end of the stream (a
+  // zero-length read, or `POLLRDHUP`); libmicrohttpd, too, closes a connection whose
+  // client has shut down its writing end, so there is no point in serving it either.
+  // Any data (e.g., a pipelined request) is left untouched in the socket's buffer.
+  short events = POLLIN;
+#ifdef POLLRDHUP
+  events |= POLLRDHUP;
+#endif
+  pollfd probe{socket, events, 0};
+  if (poll(&probe, 1, 0) <= 0) {
+    return false;
+  }
+  short closed = POLLHUP | POLLERR | POLLNVAL;
+#ifdef POLLRDHUP
+  closed |= POLLRDHUP;
+#endif
+  if ((probe.revents & closed) != 0) {
+    return true;
+  }
+  char byte;
+  auto count = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+      errno != EINTR);
+}
+
+std::chrono::milliseconds CancellationToken::remaining() const {
+  auto now = Clock::now();
+  if (now >= deadline_) {
+    return std::chrono::milliseconds::zero();
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - now);
+}
+
+bool CancellationToken::cancelled() {
+  if (cancelled_) {
+    return true;
+  }
+  if (expired()) {
+    VLOG(2) << "Request deadline expired";
+    Cancel();
+  } else if (PeerClosed()) {
+    VLOG(2) << "Client disconnected";
+    Cancel();
+  }
+  return cancelled_;
+}
+
+void CancellationToken::Cancel() {
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_) {
+      return;
+    }
+    cancelled_ = true;
+    callbacks.swap(callbacks_);
+  }
+  for (auto &callback : callbacks) {
+    callback();
+  }
+}
+
+void CancellationToken::OnCancel(const std::function<void()> &callback) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!cancelled_) {
+      callbacks_.push_back(callback);
+      return;
+    }
+  }
+  callback();
+}
+
+} // namespace rest
+} // namespace api
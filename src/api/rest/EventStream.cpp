@@ -0,0 +1,231 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/2/20.
+
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "api/rest/EventStream.hpp"
+
+namespace api {
+namespace rest {
+
+const char *const kTextEventStream = "text/event-stream";
+
+namespace {
+
+/** Shared by all heartbeats: a comment line, ignored by clients. */
+const EventBuffer &HeartbeatComment() {
+  static const EventBuffer comment = std::make_shared<const std::string>(":\n\n");
+  return comment;
+}
+
+} // namespace
+
+
+// Mark: EventSubscriber
+
+EventSubscriber::~EventSubscriber() {
+  if (budget_ != nullptr) {
+    budget_->Release(pending_.size() * sizeof(EventBuffer));
+  }
+}
+
+bool EventSubscriber::Push(const EventBuffer &event, size_t max_pending) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) {
+    return false;
+  }
+  if (pending_.size() >= max_pending) {
+    LOG(WARNING) << "Subscriber is " << pending_.size() << " events behind, disconnecting";
+    closed_ = true;
+  } else if (budget_ != nullptr && !budget_->Reserve(sizeof(EventBuffer))) {
+    LOG(WARNING) << "No memory left for the subscriber's backlog of " << pending_.size()
+                 << " events, disconnecting";
+    closed_ = true;
+  } else {
+    pending_.push_back(event);
+  }
+  if (suspended_) {
+    suspended_ = false;
+    MHD_resume_connection(connection_);
+  }
+  return !closed_;
+}
+
+bool EventSubscriber::Ping() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) {
+    return false;
+  }
+  if (!pending_.empty() || (budget_ != nullptr && !budget_->Reserve(sizeof(EventBuffer)))) {
+    return true;
+  }
+  pending_.push_back(HeartbeatComment());
+  if (suspended_) {
+    suspended_ = false;
+    MHD_resume_connection(connection_);
+  }
+  return true;
+}
+
+ssize_t EventSubscriber::Read(char *buf, size_t max) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  size_t copied = 0;
+  while (!pending_.empty() && copied < max) {
+    const auto &event = *pending_.front();
+    auto len = std::min(event.size() - offset_, max - copied);
+    memcpy(buf + copied, event.data() + offset_, len);
+    copied += len;
+    offset_ += len;
+    if (offset_ == event.size()) {
+      // Heartbeats do not count as events, for long-poll subscribers.
+      delivered_ = delivered_ || pending_.front() != HeartbeatComment();
+      pending_.pop_front();
+      offset_ = 0;
+      if (budget_ != nullptr) {
+        budget_->Release(sizeof(EventBuffer));
+      }
+    }
+  }
+  if (copied > 0) {
+    return copied;
+  }
+  if (closed_ || (long_poll_ && delivered_)) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  // Nothing to send: rather than having MHD busy-loop on us, we take the connection out of
+  // the polling set, until `Push()` has something for it.
+  if (connection_ != nullptr) {
+    suspended_ = true;
+    MHD_suspend_connection(connection_);
+  }
+  return 0;
+}
+
+void EventSubscriber::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  if (suspended_) {
+    suspended_ = false;
+    MHD_resume_connection(connection_);
+  }
+}
+
+ssize_t EventSubscriber::ContentReaderCallback(void *cls, uint64_t pos, char *buf, size_t max) {
+  return static_cast<EventSubscriber *>(cls)->Read(buf, max);
+}
+
+void EventSubscriber::ContentReaderFreeCallback(void *cls) {
+  auto subscriber = static_cast<EventSubscriber *>(cls);
+  VLOG(2) << "Connection closed, removing subscriber for "
+          << subscriber->broadcaster_->resource();
+  // The subscriber is gone once unsubscribed, but its broadcaster must outlive the call.
+  auto owner = std::move(subscriber->owner_);
+  subscriber->broadcaster_->Unsubscribe(subscriber);
+}
+
+
+// Mark: EventBroadcaster
+
+std::shared_ptr<EventSubscriber> EventBroadcaster::Subscribe(struct MHD_Connection *connection,
+                                                             bool long_poll) {
+  auto subscriber = std::make_shared<EventSubscriber>(this, connection, long_poll, budget_);
+  if (connection != nullptr) {
+    subscriber->owner_ = weak_from_this().lock();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) {
+    subscriber->closed_ = true;
+  }
+  subscribers_[subscriber.get()] = subscriber;
+  return subscriber;
+}
+
+void EventBroadcaster::Unsubscribe(const EventSubscriber *subscriber) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  subscribers_.erase(subscriber);
+}
+
+size_t EventBroadcaster::Publish(const std::string &data, const std::string &event,
+                                 const std::string &id) {
+  EventBuffer buffer;
+  auto formatted = FormatEvent(data, event, id);
+  if (budget_ == nullptr) {
+    buffer = std::make_shared<const std::string>(std::move(formatted));
+  } else {
+    // The buffer is released once the last subscriber it is queued for has sent it.
+    auto size = formatted.size();
+    if (!budget_->Reserve(size)) {
+      LOG(WARNING) << "No memory left for events of " << resource_ << ", event dropped";
+      return 0;
+    }
+    auto budget = budget_;
+    buffer = EventBuffer(new std::string(std::move(formatted)),
+                         [budget, size](const std::string *released) {
+                           budget->Release(size);
+                           delete released;
+                         });
+  }
+
+  size_t count = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &subscriber : subscribers_) {
+    if (subscriber.second->Push(buffer, max_pending_)) {
+      ++count;
+    }
+  }
+  VLOG(2) << "Event published to " << count << " subscribers of " << resource_;
+  return count;
+}
+
+size_t EventBroadcaster::Heartbeat() {
+  size_t count = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &subscriber : subscribers_) {
+    if (subscriber.second->Ping()) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+void EventBroadcaster::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  for (auto &subscriber : subscribers_) {
+    subscriber.second->Close();
+  }
+}
+
+std::string EventBroadcaster::FormatEvent(const std::string &data, const std::string &event,
+                                          const std::string &id) {
+  std::ostringstream out;
+  if (!id.empty()) {
+    out << "id: " << id << "\n";
+  }
+  if (!event.empty()) {
+    out << "event: " << event << "\n";
+  }
+
+  // Multi-line payloads must be sent as one `data` field per line.
+  std::istringstream lines(data);
+  std::string line;
+  while (std::getline(lines, line)) {
+    out << "data: " << line << "\n";
+  }
+  if (data.empty()) {
+    out << "data: \n";
+  }
+  out << "\n";
+  return out.str();
+}
+
+} // namespace rest
+} // namespace api
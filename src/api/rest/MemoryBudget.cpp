@@ -0,0 +1,115 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/27/20.
+
+
+#include <limits>
+
+#include <glog/logging.h>
+
+#include "api/rest/MemoryBudget.hpp"
+
+namespace api {
+namespace rest {
+
+// Mark: MemoryBudget
+
+void MemoryBudget::UpdatePeak(size_t used) {
+  auto peak = peak_.load();
+  while (used > peak && !peak_.compare_exchange_weak(peak, used)) {}
+}
+
+bool MemoryBudget::Reserve(size_t bytes) {
+  auto used = used_.load();
+  do {
+    // Written so as not to overflow: `bytes` may come straight from a client's request.
+    auto limit = limit_.load();
+    if (limit == 0) {
+      limit = std::numeric_limits<size_t>::max();
+    }
+    if (bytes > limit || used > limit - bytes) {
+      ++rejected_;
+      VLOG(2) << "Memory budget exhausted: " << used << " + " << bytes << " > " << limit;
+      return false;
+    }
+  } while (!used_.compare_exchange_weak(used, used + bytes));
+  UpdatePeak(used + bytes);
+  return true;
+}
+
+void MemoryBudget::ForceReserve(size_t bytes) {
+  UpdatePeak(used_ += bytes);
+}
+
+void MemoryBudget::Release(size_t bytes) {
+  used_ -= bytes;
+}
+
+bool MemoryBudget::Fits(size_t bytes) const {
+  auto limit = limit_.load();
+  if (limit == 0) {
+    return true;
+  }
+  return bytes <= limit && used_ <= limit - bytes;
+}
+
+
+// Mark: BufferPool
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept {
+  if (this != &other) {
+    if (data_ != nullptr) {
+      pool_->Recycle(data_);
+    }
+    pool_ = other.pool_;
+    data_ = other.data_;
+    other.data_ = nullptr;
+  }
+  return *this;
+}
+
+BufferPool::Buffer::~Buffer() {
+  if (data_ != nullptr) {
+    pool_->Recycle(data_);
+  }
+}
+
+BufferPool::~BufferPool() {
+  LOG_IF(ERROR, free_.size() != slabs_.size() * buffers_per_slab_)
+      << "Buffer pool destroyed while buffers are still in use";
+  budget_->Release(slabs_.size() * buffers_per_slab_ * buffer_size_);
+}
+
+BufferPool::Buffer BufferPool::Acquire() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_.empty()) {
+    auto slab_size = buffers_per_slab_ * buffer_size_;
+    if (!budget_->Reserve(slab_size)) {
+      return Buffer{};
+    }
+    slabs_.emplace_back(new char[slab_size]);
+    for (size_t i = 0; i < buffers_per_slab_; ++i) {
+      free_.push_back(slabs_.back().get() + i * buffer_size_);
+    }
+  }
+  auto data = free_.back();
+  free_.pop_back();
+  return Buffer{this, data};
+}
+
+void BufferPool::Recycle(char *data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(data);
+}
+
+size_t BufferPool::allocated() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return slabs_.size() * buffers_per_slab_ * buffer_size_;
+}
+
+size_t BufferPool::available() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return free_.size();
+}
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,106 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/20/20.
+
+
+#include <exception>
+#include <thread>
+
+#include <glog/logging.h>
+
+#include "api/rest/SingleFlight.hpp"
+
+namespace api {
+namespace rest {
+
+std::string SingleFlight::Key(const std::string &resource,
+                              const std::map<std::string, std::string> &args) {
+  // Arguments are already sorted by name; NUL cannot appear in (decoded) names or values.
+  std::string key{resource};
+  for (const auto &arg : args) {
+    key.push_back('\0');
+    key.append(arg.first);
+    key.push_back('\0');
+    key.append(arg.second);
+  }
+  return key;
+}
+
+std::shared_ptr<const SingleFlight::Flight> SingleFlight::Join(
+    const std::string &key, MHD_Connection *connection, Call call) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // The connection is suspended while holding the lock, so that it cannot be resumed
+  // (by `Complete()`) before it is suspended.
+  if (connection != nullptr) {
+    MHD_suspend_connection(connection);
+  }
+  auto flight = flights_.find(key);
+  if (flight != flights_.end()) {
+    VLOG(2) << "Request coalesced with " << flight->second->waiters.size() << " others";
+    flight->second->waiters.push_back(connection);
+    return flight->second;
+  }
+
+  auto started = std::make_shared<Flight>();
+  started->waiters.push_back(connection);
+  flights_.emplace(key, started);
+
+  queue_.push_back(Task{key, started, std::move(call)});
+  if (workers_ < max_workers_) {
+    ++workers_;
+    std::thread([self = shared_from_this()]() { self->Work(); }).detach();
+  }
+  return started;
+}
+
+void SingleFlight::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!queue_.empty()) {
+    auto task = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+
+    try {
+      task.call(&task.flight->result);
+    } catch (const std::exception &ex) {
+      LOG(ERROR) << "Coalesced request failed: " << ex.what();
+    } catch (...) {
+      LOG(ERROR) << "Coalesced request failed";
+    }
+    // Whatever the call holds (e.g., the handler) is released before the waiters are
+    // resumed, and the result (if they are all done with it) before the worker is idle:
+    // `Drain()` waits for both.
+    task.call = nullptr;
+    Complete(task.key, task.flight);
+    task.flight.reset();
+
+    lock.lock();
+  }
+  --workers_;
+  idle_.notify_all();
+}
+
+void SingleFlight::Complete(const std::string &key, const std::shared_ptr<Flight> &flight) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  flights_.erase(key);
+  VLOG(2) << "Resuming " << flight->waiters.size() << " coalesced requests";
+  for (auto connection : flight->waiters) {
+    if (connection != nullptr) {
+      MHD_resume_connection(connection);
+    }
+  }
+  idle_.notify_all();
+}
+
+size_t SingleFlight::in_flight() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return flights_.size();
+}
+
+void SingleFlight::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return flights_.empty() && workers_ == 0; });
+}
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,308 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/6/20.
+
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
+
+#include <glog/logging.h>
+
+#include "api/rest/Tracing.hpp"
+
+namespace api {
+namespace rest {
+
+namespace {
+
+const char *const kPhaseNames[kTracePhases] = {"parse", "route", "handler", "serialize", "send"};
+
+std::string Hex(uint64_t value) {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << value;
+  return out.str();
+}
+
+/** Span IDs for the phases are derived from the request's, so they need not be stored. */
+uint64_t PhaseSpanId(const TraceSample &sample, size_t phase) {
+  return sample.span_id ^ ((phase + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+std::string JsonEscape(const std::string &value) {
+  std::string escaped;
+  for (char c : value) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          std::ostringstream code;
+          code << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c);
+          escaped += code.str();
+        } else {
+          escaped += c;
+        }
+    }
+  }
+  return escaped;
+}
+
+void WriteOtlpSpan(std::ostream &out, const TraceSample &sample, const std::string &span_id,
+                   const std::string &parent_id, const std::string &name, int kind,
+                   uint64_t start_ns, uint64_t end_ns, bool with_attributes) {
+  out << "{\"traceId\":\"" << Hex(sample.trace_id_high) << Hex(sample.trace_id_low)
+      << "\",\"spanId\":\"" << span_id << "\"";
+  if (!parent_id.empty()) {
+    out << ",\"parentSpanId\":\"" << parent_id << "\"";
+  }
+  out << ",\"name\":\"" << JsonEscape(name) << "\",\"kind\":" << kind
+      << ",\"startTimeUnixNano\":\"" << start_ns << "\""
+      << ",\"endTimeUnixNano\":\"" << end_ns << "\"";
+  if (with_attributes) {
+    out << ",\"attributes\":["
+        << "{\"key\":\"http.request.method\",\"value\":{\"stringValue\":\""
+        << JsonEscape(sample.method) << "\"}},"
+        << "{\"key\":\"url.path\",\"value\":{\"stringValue\":\""
+        << JsonEscape(sample.resource) << "\"}},"
+        << "{\"key\":\"http.response.status_code\",\"value\":{\"intValue\":\""
+        << sample.status_code << "\"}}]";
+  }
+  out << "}";
+}
+
+} // namespace
+
+const char *TracePhaseName(TracePhase phase) {
+  auto index = static_cast<size_t>(phase);
+  return index < kTracePhases ? kPhaseNames[index] : "unknown";
+}
+
+
+// Mark: Exporters
+
+ChromeTraceExporter::ChromeTraceExporter(const std::string &filename) : out_(filename) {
+  if (!out_) {
+    LOG(ERROR) << "Cannot open trace file " << filename;
+  }
+  out_ << "[\n";
+}
+
+void ChromeTraceExporter::Export(const std::vector<TraceSample> &samples) {
+  for (const auto &sample : samples) {
+    Write(sample, out_);
+  }
+  out_.flush();
+}
+
+void ChromeTraceExporter::Write(const TraceSample &sample, std::ostream &out) {
+  // Timestamps and durations are in microseconds.
+  auto event = [&](const std::string &name, uint64_t start_ns, uint64_t duration_ns) {
+    out << "{\"name\":\"" << JsonEscape(name) << "\",\"cat\":\"http\",\"ph\":\"X\""
+        << ",\"ts\":" << std::fixed << std::setprecision(3) << start_ns / 1000.0
+        << ",\"dur\":" << duration_ns / 1000.0
+        << ",\"pid\":1,\"tid\":" << sample.thread_id
+        << ",\"args\":{\"trace_id\":\"" << Hex(sample.trace_id_high) << Hex(sample.trace_id_low)
+        << "\",\"status\":" << sample.status_code << "}},\n";
+  };
+
+  event(sample.method + " " + sample.resource, sample.start_ns, sample.end_ns - sample.start_ns);
+  for (size_t phase = 0; phase < kTracePhases; ++phase) {
+    if (sample.phase_start_ns[phase] != 0) {
+      event(kPhaseNames[phase], sample.phase_start_ns[phase], sample.phase_duration_ns[phase]);
+    }
+  }
+}
+
+void OtlpJsonExporter::Export(const std::vector<TraceSample> &samples) {
+  Write(samples, service_name_, out_);
+  out_ << "\n";
+  out_.flush();
+}
+
+void OtlpJsonExporter::Write(const std::vector<TraceSample> &samples,
+                             const std::string &service_name,
+                             std::ostream &out) {
+  const int kSpanKindInternal = 1;
+  const int kSpanKindServer = 2;
+
+  out << "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+      << "{\"key\":\"service.name\",\"value\":{\"stringValue\":\""
+      << JsonEscape(service_name) << "\"}}]},"
+      << "\"scopeSpans\":[{\"scope\":{\"name\":\"apiserver\"},\"spans\":[";
+
+  bool first = true;
+  for (const auto &sample : samples) {
+    if (!first) {
+      out << ",";
+    }
+    first = false;
+
+    auto span_id = Hex(sample.span_id);
+    WriteOtlpSpan(out, sample, span_id, "", sample.method + " " + sample.resource,
+                  kSpanKindServer, sample.start_ns, sample.end_ns, true);
+    for (size_t phase = 0; phase < kTracePhases; ++phase) {
+      if (sample.phase_start_ns[phase] != 0) {
+        out << ",";
+        WriteOtlpSpan(out, sample, Hex(PhaseSpanId(sample, phase)), span_id,
+                      kPhaseNames[phase], kSpanKindInternal, sample.phase_start_ns[phase],
+                      sample.phase_start_ns[phase] + sample.phase_duration_ns[phase], false);
+      }
+    }
+  }
+  out << "]}]}]}";
+}
+
+
+// Mark: Tracer
+
+std::atomic<uint64_t> Tracer::next_id_{1};
+
+Tracer::Tracer(std::shared_ptr<TraceExporter> exporter,
+               double sampling_rate,
+               std::chrono::milliseconds flush_interval,
+               size_t buffer_size) :
+    id_(next_id_++),
+    exporter_(std::move(exporter)),
+    period_(sampling_rate > 0 ? std::max<uint64_t>(1, std::llround(1.0 / sampling_rate)) : 0),
+    buffer_size_(std::max<size_t>(1, buffer_size)) {
+
+  if (flush_interval.count() > 0) {
+    flusher_ = std::thread([this, flush_interval]() {
+      std::unique_lock<std::mutex> lock(flusher_mutex_);
+      while (!flusher_cv_.wait_for(lock, flush_interval, [this] { return stopped_; })) {
+        lock.unlock();
+        Flush();
+        lock.lock();
+      }
+    });
+  }
+}
+
+Tracer::~Tracer() {
+  {
+    std::lock_guard<std::mutex> lock(flusher_mutex_);
+    stopped_ = true;
+  }
+  flusher_cv_.notify_all();
+  if (flusher_.joinable()) {
+    flusher_.join();
+  }
+  Flush();
+}
+
+TraceBuffer *Tracer::Sample() {
+  if (period_ == 0) {
+    return nullptr;
+  }
+
+  // Tracer IDs are never reused, so a stale entry (for a destroyed tracer) is never looked up.
+  thread_local std::unordered_map<uint64_t, TraceBuffer *> local_buffers;
+  auto &buffer = local_buffers[id_];
+  if (buffer == nullptr) {
+    auto created = std::make_shared<TraceBuffer>();
+    created->thread_id = std::hash<std::thread::id>()(std::this_thread::get_id());
+    created->random.seed(std::random_device()());
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    buffers_.push_back(created);
+    buffer = created.get();
+  }
+  return buffer->counter++ % period_ == 0 ? buffer : nullptr;
+}
+
+void Tracer::Record(TraceBuffer *buffer, TraceSample &&sample) {
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  sample.thread_id = buffer->thread_id;
+  sample.trace_id_high = buffer->random();
+  sample.trace_id_low = buffer->random();
+  sample.span_id = buffer->random();
+
+  if (buffer->samples.size() < buffer_size_) {
+    buffer->samples.push_back(std::move(sample));
+  } else {
+    buffer->samples[buffer->next] = std::move(sample);
+    buffer->next = (buffer->next + 1) % buffer_size_;
+    ++buffer->dropped;
+  }
+}
+
+void Tracer::Flush() {
+  std::vector<std::shared_ptr<TraceBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    buffers = buffers_;
+  }
+
+  std::vector<TraceSample> samples;
+  for (auto &buffer : buffers) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    std::move(buffer->samples.begin(), buffer->samples.end(), std::back_inserter(samples));
+    buffer->samples.clear();
+    buffer->next = 0;
+  }
+
+  if (!samples.empty() && exporter_) {
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    exporter_->Export(samples);
+  }
+}
+
+uint64_t Tracer::dropped() {
+  std::lock_guard<std::mutex> lock(buffers_mutex_);
+  uint64_t dropped = 0;
+  for (auto &buffer : buffers_) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    dropped += buffer->dropped;
+  }
+  return dropped;
+}
+
+
+// Mark: RequestTrace
+
+void RequestTrace::Start(Tracer *tracer, const char *method, const std::string &resource) {
+  buffer_ = tracer->Sample();
+  if (buffer_ != nullptr) {
+    tracer_ = tracer;
+    method_ = method;
+    resource_ = resource;
+    start_ = Clock::now();
+  }
+}
+
+void RequestTrace::Record() {
+  auto now = Clock::now();
+  Leave(now);
+
+  // Converts steady clock times to the wall clock, as expected by the exporters.
+  auto offset = std::chrono::system_clock::now().time_since_epoch() - now.time_since_epoch();
+  auto to_unix_ns = [offset](Clock::time_point time) -> uint64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time.time_since_epoch() + offset).count();
+  };
+
+  TraceSample sample{};
+  sample.method = std::move(method_);
+  sample.resource = std::move(resource_);
+  sample.status_code = status_code_;
+  sample.start_ns = to_unix_ns(start_);
+  sample.end_ns = to_unix_ns(now);
+  for (size_t phase = 0; phase < kTracePhases; ++phase) {
+    if (first_entered_[phase] != Clock::time_point{}) {
+      sample.phase_start_ns[phase] = to_unix_ns(first_entered_[phase]);
+      sample.phase_duration_ns[phase] =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(durations_[phase]).count();
+    }
+  }
+  tracer_->Record(buffer_, std::move(sample));
+  buffer_ = nullptr;
+}
+
+} // namespace rest
+} // namespace api
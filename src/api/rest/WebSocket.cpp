@@ -0,0 +1,453 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/9/20.
+
+
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+#include "api/rest/WebSocket.hpp"
+
+namespace api {
+namespace rest {
+
+const size_t kMaxWebSocketMessageSize = 16 * 1024 * 1024;
+const std::chrono::milliseconds kWebSocketSendTimeout{10000};
+
+namespace {
+
+const char *const kWebSocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const size_t kReadBufferSize = 16 * 1024;
+
+inline uint32_t rotl(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+/**
+ * SHA-1 is only used to compute the handshake's accept key, as mandated by RFC 6455: it is
+ * not used for anything security-sensitive, and does not warrant a dependency on OpenSSL.
+ */
+std::string Sha1(const std::string &input) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+  std::string msg{input};
+  uint64_t bit_len = static_cast<uint64_t>(input.size()) * 8;
+  msg.push_back(static_cast<char>(0x80));
+  while (msg.size() % 64 != 56) {
+    msg.push_back('\0');
+  }
+  for (int i = 7; i >= 0; --i) {
+    msg.push_back(static_cast<char>((bit_len >> (i * 8)) & 0xFF));
+  }
+
+  for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      auto p = reinterpret_cast<const uint8_t *>(msg.data() + chunk + i * 4);
+      w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+    for (int i = 16; i < 80; ++i) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  std::string digest;
+  for (auto word : h) {
+    for (int i = 3; i >= 0; --i) {
+      digest.push_back(static_cast<char>((word >> (i * 8)) & 0xFF));
+    }
+  }
+  return digest;
+}
+
+std::string Base64Encode(const std::string &input) {
+  static const char *const kAlphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    uint32_t n = (uint8_t(input[i]) << 16) | (uint8_t(input[i + 1]) << 8) | uint8_t(input[i + 2]);
+    out.push_back(kAlphabet[(n >> 18) & 0x3F]);
+    out.push_back(kAlphabet[(n >> 12) & 0x3F]);
+    out.push_back(kAlphabet[(n >> 6) & 0x3F]);
+    out.push_back(kAlphabet[n & 0x3F]);
+  }
+  if (i < input.size()) {
+    uint32_t n = uint8_t(input[i]) << 16;
+    if (i + 1 < input.size()) {
+      n |= uint8_t(input[i + 1]) << 8;
+    }
+    out.push_back(kAlphabet[(n >> 18) & 0x3F]);
+    out.push_back(kAlphabet[(n >> 12) & 0x3F]);
+    out.push_back(i + 1 < input.size() ? kAlphabet[(n >> 6) & 0x3F] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+bool IsControl(WebSocketOpcode opcode) {
+  return (static_cast<uint8_t>(opcode) & 0x08) != 0;
+}
+
+} // namespace
+
+
+// Mark: Framing
+
+void ApplyWebSocketMask(char *data, size_t len, const uint8_t mask[4]) {
+  uint32_t key32;
+  memcpy(&key32, mask, sizeof(key32));
+  size_t i = 0;
+
+  // All the block sizes below are multiples of 4, so the mask stays aligned with the data
+  // as we move from one loop to the next.
+#ifdef __AVX2__
+  auto key256 = _mm256_set1_epi32(static_cast<int>(key32));
+  for (; i + 32 <= len; i += 32) {
+    auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), _mm256_xor_si256(block, key256));
+  }
+#endif
+#ifdef __SSE2__
+  auto key128 = _mm_set1_epi32(static_cast<int>(key32));
+  for (; i + 16 <= len; i += 16) {
+    auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(block, key128));
+  }
+#endif
+  uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t block;
+    memcpy(&block, data + i, sizeof(block));
+    block ^= key64;
+    memcpy(data + i, &block, sizeof(block));
+  }
+  for (; i < len; ++i) {
+    data[i] ^= static_cast<char>(mask[i % 4]);
+  }
+}
+
+std::string EncodeWebSocketFrame(WebSocketOpcode opcode, const std::string &payload) {
+  std::string frame;
+  frame.reserve(payload.size() + 10);
+  frame.push_back(static_cast<char>(0x80 | static_cast<uint8_t>(opcode)));
+
+  auto len = payload.size();
+  if (len < 126) {
+    frame.push_back(static_cast<char>(len));
+  } else if (len <= 0xFFFF) {
+    frame.push_back(static_cast<char>(126));
+    frame.push_back(static_cast<char>((len >> 8) & 0xFF));
+    frame.push_back(static_cast<char>(len & 0xFF));
+  } else {
+    frame.push_back(static_cast<char>(127));
+    for (int i = 7; i >= 0; --i) {
+      frame.push_back(static_cast<char>((static_cast<uint64_t>(len) >> (i * 8)) & 0xFF));
+    }
+  }
+  frame.append(payload);
+  return frame;
+}
+
+std::string WebSocketAcceptKey(const std::string &key) {
+  return Base64Encode(Sha1(key + kWebSocketGuid));
+}
+
+bool WebSocketFrameParser::Parse(const char *data, size_t len,
+                                 std::vector<WebSocketFrame> *frames) {
+  buffer_.append(data, len);
+
+  size_t pos = 0;
+  while (buffer_.size() - pos >= 2) {
+    auto header = reinterpret_cast<const uint8_t *>(buffer_.data() + pos);
+    bool fin = (header[0] & 0x80) != 0;
+    auto opcode = static_cast<WebSocketOpcode>(header[0] & 0x0F);
+    bool masked = (header[1] & 0x80) != 0;
+    uint64_t payload_len = header[1] & 0x7F;
+
+    if ((header[0] & 0x70) != 0 || !masked) {
+      LOG(ERROR) << "Invalid WebSocket frame: reserved bits set, or unmasked client frame";
+      return false;
+    }
+    if (IsControl(opcode) && (!fin || payload_len > 125)) {
+      LOG(ERROR) << "Invalid WebSocket control frame";
+      return false;
+    }
+
+    size_t header_len = 2;
+    if (payload_len == 126) {
+      header_len += 2;
+    } else if (payload_len == 127) {
+      header_len += 8;
+    }
+    header_len += 4;  // The masking key.
+    if (buffer_.size() - pos < header_len) {
+      break;
+    }
+    if (payload_len >= 126) {
+      size_t len_bytes = header_len - 6;
+      payload_len = 0;
+      for (size_t i = 0; i < len_bytes; ++i) {
+        payload_len = (payload_len << 8) | header[2 + i];
+      }
+    }
+    if (payload_len > max_payload_) {
+      LOG(ERROR) << "WebSocket frame too large: " << payload_len << " bytes";
+      return false;
+    }
+    if (buffer_.size() - pos - header_len < payload_len) {
+      break;
+    }
+
+    WebSocketFrame frame{fin, opcode,
+                         buffer_.substr(pos + header_len, static_cast<size_t>(payload_len))};
+    ApplyWebSocketMask(&frame.payload[0], frame.payload.size(), header + header_len - 4);
+    frames->push_back(std::move(frame));
+    pos += header_len + payload_len;
+  }
+  buffer_.erase(0, pos);
+  return true;
+}
+
+
+// Mark: WebSocketRegistry
+
+WebSocketRegistry::WebSocketRegistry(MemoryBudget *budget) :
+    buffers_(budget, kReadBufferSize) {}
+
+void WebSocketRegistry::Add(WebSocketSession *session) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_.insert(session);
+}
+
+void WebSocketRegistry::Remove(WebSocketSession *session) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_.erase(session);
+  cv_.notify_all();
+}
+
+void WebSocketRegistry::CloseAll() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto session : sessions_) {
+    session->Shutdown();
+  }
+  cv_.wait(lock, [this] { return sessions_.empty(); });
+}
+
+
+// Mark: WebSocketSession
+
+bool WebSocketSession::WriteAll(const std::string &data) {
+  auto deadline = std::chrono::steady_clock::now() + kWebSocketSendTimeout;
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto count = send(socket_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (count > 0) {
+      sent += count;
+    } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      pollfd pfd{socket_, POLLOUT, 0};
+      if (left.count() <= 0 || poll(&pfd, 1, static_cast<int>(left.count())) == 0) {
+        LOG(WARNING) << "WebSocket client for " << resource_ << " is not reading, closing";
+        // Also terminates `Run()`; the socket is still ours, as we hold `write_mutex_`.
+        shutdown(socket_, SHUT_RDWR);
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool WebSocketSession::Send(const std::string &data, bool binary) {
+  auto frame = EncodeWebSocketFrame(binary ? WebSocketOpcode::kBinary : WebSocketOpcode::kText,
+                                    data);
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  return !closed_ && WriteAll(frame);
+}
+
+void WebSocketSession::Close(uint16_t code) {
+  std::string payload{static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if (!closed_) {
+    WriteAll(EncodeWebSocketFrame(WebSocketOpcode::kClose, payload));
+  }
+}
+
+void WebSocketSession::Shutdown() {
+  // Also wakes up any writer blocked on the socket, which then fails.
+  std::lock_guard<std::mutex> lock(state_mutex_);
+  if (!closed_) {
+    shutdown(socket_, SHUT_RDWR);
+  }
+}
+
+void WebSocketSession::Dispatch(const WebSocketMessage &message) {
+  try {
+    handler_(*this, message);
+  } catch (const std::exception &ex) {
+    LOG(ERROR) << "WebSocket handler for " << resource_ << " failed: " << ex.what();
+  }
+}
+
+void WebSocketSession::Run(std::string extra_in) {
+  WebSocketFrameParser parser;
+  std::vector<WebSocketFrame> frames;
+  WebSocketMessage message{"", false};
+  bool fragmented = false;
+  bool done = false;
+
+  auto buf = registry_->buffers().Acquire();
+  if (!buf) {
+    LOG(WARNING) << "Out of memory budget, closing WebSocket for " << resource_;
+    Close(1013);    // Try Again Later.
+    done = true;
+  }
+  auto data = extra_in.data();
+  ssize_t count = extra_in.size();
+
+  while (!done) {
+    if (count > 0) {
+      frames.clear();
+      if (!parser.Parse(data, count, &frames)) {
+        Close(1002);
+        break;
+      }
+      for (auto &frame : frames) {
+        switch (frame.opcode) {
+          case WebSocketOpcode::kPing: {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            WriteAll(EncodeWebSocketFrame(WebSocketOpcode::kPong, frame.payload));
+            break;
+          }
+          case WebSocketOpcode::kPong:
+            break;
+          case WebSocketOpcode::kClose: {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            WriteAll(EncodeWebSocketFrame(WebSocketOpcode::kClose, frame.payload.substr(0, 2)));
+            done = true;
+            break;
+          }
+          case WebSocketOpcode::kText:
+          case WebSocketOpcode::kBinary:
+          case WebSocketOpcode::kContinuation:
+            if ((frame.opcode == WebSocketOpcode::kContinuation) != fragmented ||
+                message.data.size() + frame.payload.size() > kMaxWebSocketMessageSize) {
+              Close(1002);
+              done = true;
+              break;
+            }
+            if (!fragmented) {
+              message.binary = frame.opcode == WebSocketOpcode::kBinary;
+              message.data = std::move(frame.payload);
+            } else {
+              message.data.append(frame.payload);
+            }
+            fragmented = !frame.fin;
+            if (frame.fin) {
+              Dispatch(message);
+            }
+            break;
+          default:
+            LOG(ERROR) << "Unknown WebSocket opcode: " << static_cast<int>(frame.opcode);
+            Close(1002);
+            done = true;
+        }
+        if (done) {
+          break;
+        }
+      }
+      if (done) {
+        break;
+      }
+    }
+
+    count = recv(socket_, buf.data(), buf.size(), 0);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      pollfd pfd{socket_, POLLIN, 0};
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (count <= 0) {
+      VLOG(2) << "WebSocket client for " << resource_ << " disconnected";
+      break;
+    }
+    data = buf.data();
+  }
+
+  {
+    // Unblocks any writer still waiting on the client, so that we never wait for it.
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    closed_ = true;
+    shutdown(socket_, SHUT_RDWR);
+  }
+  {
+    // Writers check `closed_` holding this lock: once we have it, none is using the socket.
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    MHD_upgrade_action(urh_, MHD_UPGRADE_ACTION_CLOSE);
+  }
+  // The pool is owned by the registry, which may be destroyed as soon as we are removed.
+  buf = BufferPool::Buffer{};
+  registry_->Remove(this);
+}
+
+void WebSocketSession::UpgradeHandler(void *cls,
+                                      struct MHD_Connection *connection,
+                                      void *con_cls,
+                                      const char *extra_in,
+                                      size_t extra_in_size,
+                                      MHD_socket sock,
+                                      struct MHD_UpgradeResponseHandle *urh) {
+  auto endpoint = static_cast<WebSocketEndpoint *>(cls);
+  auto session = std::make_shared<WebSocketSession>(endpoint->resource, endpoint->handler,
+                                                    endpoint->registry, sock, urh);
+  endpoint->registry->Add(session.get());
+
+  VLOG(2) << "WebSocket connection established for " << endpoint->resource;
+  std::thread([session](std::string pending) {
+    session->Run(std::move(pending));
+  }, std::string{extra_in, extra_in_size}).detach();
+}
+
+} // namespace rest
+} // namespace api
@@ -0,0 +1,96 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 7/4/20.
+
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+
+#include <glog/logging.h>
+
+#include "api/rest/ApiServer.hpp"
+
+#include "version.h"
+
+#include "distlib/utils/ParseArgs.hpp"
+#include "distlib/utils/utils.hpp"
+
+namespace {
+
+/**
+ * Prints out usage instructions for this application.
+ */
+void usage() {
+  std::cout << "Usage: event_loop_demo [--port=PORT] [--help]\n\n"
+            << "Runs an ApiServer from the application's own epoll loop (which also runs\n"
+            << "a once-a-second timer), rather than in a separate thread.\n"
+            << "Use `curl localhost:PORT/api/v1/stop` to terminate.\n\n"
+            << "\t--port  the TCP port to listen on (default: 6060)\n"
+            << "\t--help  prints this message and exits\n\n";
+}
+
+} // namespace
+
+
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+
+  ::utils::ParseArgs parser(argv, argc);
+  if (parser.has("help")) {
+    usage();
+    return EXIT_SUCCESS;
+  }
+  ::utils::PrintVersion("Event Loop Demo", RELEASE_STR);
+
+  // Handlers added with `AddGet()` run on the loop's thread: no synchronization is needed
+  // to share state with the rest of the loop. Coalesced GET and WebSocket handlers would
+  // run on their own threads instead.
+  bool stopped = false;
+  uint64_t ticks = 0;
+
+  api::rest::ApiServer server(parser.getUInt("port", 6060));
+  server.set_external_event_loop(true);
+  server.AddGet("ticks", [&ticks](const api::rest::Request &req) {
+    return api::rest::Response::ok(std::to_string(ticks), true);
+  });
+  server.AddGet("stop", [&stopped](const api::rest::Request &req) {
+    stopped = true;
+    return api::rest::Response::ok("Stopping server", true);
+  });
+  server.Start();
+
+  auto timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  itimerspec interval{{1, 0}, {1, 0}};
+  timerfd_settime(timer, 0, &interval, nullptr);
+
+  auto loop = epoll_create1(0);
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = server.epoll_fd();
+  epoll_ctl(loop, EPOLL_CTL_ADD, server.epoll_fd(), &event);
+  event.data.fd = timer;
+  epoll_ctl(loop, EPOLL_CTL_ADD, timer, &event);
+
+  epoll_event ready[8];
+  while (!stopped) {
+    auto count = epoll_wait(loop, ready, 8, static_cast<int>(server.NextTimeout()));
+    for (int i = 0; i < count; ++i) {
+      if (ready[i].data.fd == timer) {
+        uint64_t expirations;
+        if (read(timer, &expirations, sizeof(expirations)) > 0) {
+          ticks += expirations;
+        }
+      }
+    }
+    // Also needed when the wait times out, to expire idle connections.
+    server.RunOnce();
+  }
+
+  close(timer);
+  close(loop);
+  LOG(INFO) << "done";
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/30/20.
+
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "api/rest/StaticRouter.hpp"
+
+#include "version.h"
+
+#include "distlib/utils/ParseArgs.hpp"
+#include "distlib/utils/utils.hpp"
+
+using namespace api::rest;
+
+namespace {
+
+/**
+ * Prints out usage instructions for this application.
+ */
+void usage() {
+  std::cout << "Usage: routes_benchmark [--iterations=N] [--help]\n\n"
+            << "Compares the time taken to route (and invoke the handler for) a request\n"
+            << "using a compile-time `StaticRouter`, against the `RouteTable` used for\n"
+            << "handlers registered at runtime.\n\n"
+            << "\t--iterations  how many lookups to run for each router (default: 10M)\n"
+            << "\t--help        prints this message and exits\n\n";
+}
+
+constexpr auto kHandler = [](const Request &request) { return Response(200, "OK"); };
+
+constexpr auto kStaticRoutes = MakeStaticRouter(
+    StaticGet("users", kHandler), StaticGet("orders", kHandler), StaticGet("items", kHandler),
+    StaticGet("carts", kHandler), StaticGet("status", kHandler), StaticGet("health", kHandler),
+    StaticPost("users", kHandler), StaticPost("orders", kHandler),
+    StaticPost("items", kHandler), StaticPost("carts", kHandler),
+    StaticPut("users", kHandler), StaticDelete("users", kHandler));
+
+const std::vector<std::pair<std::string, std::string>> kRequests = {
+    {"GET", "users"}, {"GET", "orders"}, {"POST", "items"}, {"GET", "health"},
+    {"DELETE", "users"}, {"GET", "missing"}, {"POST", "carts"}, {"GET", "status"}
+};
+
+template <typename F>
+double Measure(const std::string &name, unsigned long iterations, const F &route) {
+  Request request;
+  unsigned long found = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; ++i) {
+    const auto &req = kRequests[i % kRequests.size()];
+    found += route(req.first, req.second, request);
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+
+  auto per_call = static_cast<double>(elapsed) / iterations;
+  std::cout << std::setw(12) << name << ": " << std::fixed << std::setprecision(1)
+            << per_call << " nsec/request (" << found << " routed)" << std::endl;
+  return per_call;
+}
+
+} // namespace
+
+
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+
+  ::utils::ParseArgs parser(argv, argc);
+  if (parser.has("help")) {
+    usage();
+    return EXIT_SUCCESS;
+  }
+  ::utils::PrintVersion("Routes Benchmark", RELEASE_STR);
+  unsigned long iterations = parser.getUInt("iterations", 10000000);
+
+  // The same routes, registered at runtime, as `ApiServer` would.
+  Router router;
+  kStaticRoutes.ForEach([&router](const std::string &method, const std::string &resource) {
+    router.Update([&](RouteTable *routes) {
+      routes->handlers[method][resource] = kHandler;
+    });
+  });
+
+  auto runtime = Measure("runtime", iterations,
+      [&router](const std::string &method, const std::string &resource,
+                const Request &request) {
+        auto routes = router.routes();
+        auto handler = routes->FindHandler(method, resource);
+        return handler != nullptr && (*handler)(request).status_code() == 200;
+      });
+
+  // As `ApiServer` does, the compiled routes are found via the current `RouteTable`, and
+  // called through the `CompiledRoutes` interface: calling `kStaticRoutes` directly would let
+  // the compiler devirtualize (and inline) the calls, which the server does not get to.
+  Router compiled_router;
+  compiled_router.Update([](RouteTable *routes) { routes->compiled = &kStaticRoutes; });
+
+  auto compiled = Measure("compiled", iterations,
+      [&compiled_router](const std::string &method, const std::string &resource,
+                         const Request &request) {
+        auto routes = compiled_router.routes();
+        const CompiledRoutes &compiled = *routes->compiled;
+        auto index = compiled.Find(method, resource);
+        return index >= 0 && compiled.Invoke(index, request).status_code() == 200;
+      });
+
+  std::cout << "Speedup: " << std::setprecision(2) << runtime / compiled << "x" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -75,6 +75,14 @@ int main(int argc, const char **argv) {
     }
     return resp;
   });
+  server.AddGet("memory", [&server](const api::rest::Request& req) {
+    const auto &memory = server.memory_budget();
+    return api::rest::Response::ok(
+        "{\"used\": " + std::to_string(memory.used()) +
+        ", \"peak\": " + std::to_string(memory.peak()) +
+        ", \"limit\": " + std::to_string(memory.limit()) +
+        ", \"rejected\": " + std::to_string(memory.rejected()) + "}");
+  });
   server.AddGet("stop", [=](const api::rest::Request& req) {
     ::stopped.store(true);
     return api::rest::Response::ok("Stopping server", true);
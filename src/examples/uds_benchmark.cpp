@@ -0,0 +1,186 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/13/20.
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "api/rest/ApiServer.hpp"
+
+#include "version.h"
+
+#include "distlib/utils/ParseArgs.hpp"
+#include "distlib/utils/utils.hpp"
+
+using namespace api::rest;
+
+namespace {
+
+const unsigned int kDefaultPort = 7998;
+const char *const kDefaultSocket = "/tmp/apiserver-benchmark.sock";
+const char *const kRequest = "GET /api/v1/ping HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+/**
+ * Prints out usage instructions for this application.
+ */
+void usage() {
+  std::cout << "Usage: uds_benchmark [--requests=N] [--clients=N] [--port=PORT] "
+            << "[--socket=PATH] [--help]\n\n"
+            << "Compares the latency of requests sent to an ApiServer over loopback TCP,\n"
+            << "and over a Unix domain socket, using keep-alive connections.\n\n"
+            << "\t--requests  how many requests each client sends (default: 100000)\n"
+            << "\t--clients   number of concurrent clients (default: 1)\n"
+            << "\t--port      the TCP port to listen on (default: " << kDefaultPort << ")\n"
+            << "\t--socket    the Unix socket to listen on (default: " << kDefaultSocket
+            << "; use @name for an abstract socket)\n"
+            << "\t--help      prints this message and exits\n\n";
+}
+
+int Connect(const std::string &socket_path, unsigned int port) {
+  if (!socket_path.empty()) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+    auto len = offsetof(sockaddr_un, sun_path) + socket_path.size();
+    if (socket_path[0] == '@') {
+      addr.sun_path[0] = '\0';
+    } else {
+      ++len;
+    }
+    auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    return connect(fd, reinterpret_cast<sockaddr *>(&addr), len) == 0 ? fd : -1;
+  }
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  auto fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 ? fd : -1;
+}
+
+/**
+ * Sends a request, and reads the response (headers, and `Content-Length` bytes of body).
+ *
+ * @return whether a complete response was received
+ */
+bool RoundTrip(int fd, std::string &buffer) {
+  if (send(fd, kRequest, strlen(kRequest), MSG_NOSIGNAL) < 0) {
+    return false;
+  }
+  buffer.clear();
+  char chunk[4096];
+  size_t expected = std::string::npos;
+  while (buffer.size() < expected) {
+    auto received = recv(fd, chunk, sizeof(chunk), 0);
+    if (received <= 0) {
+      return false;
+    }
+    buffer.append(chunk, received);
+    auto end = buffer.find("\r\n\r\n");
+    if (expected == std::string::npos && end != std::string::npos) {
+      auto length = buffer.find("Content-Length: ");
+      expected = end + 4 + (length < end ? std::stoul(buffer.substr(length + 16)) : 0);
+    }
+  }
+  return true;
+}
+
+void Measure(const std::string &name, const std::string &socket_path, unsigned int port,
+             unsigned long requests, unsigned int clients) {
+  std::vector<std::vector<double>> latencies(clients);
+  std::vector<std::thread> threads;
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < clients; ++i) {
+    threads.emplace_back([&, i]() {
+      auto fd = Connect(socket_path, port);
+      if (fd < 0) {
+        LOG(ERROR) << "Cannot connect to the " << name << " server";
+        return;
+      }
+      std::string buffer;
+      latencies[i].reserve(requests);
+      for (unsigned long n = 0; n < requests; ++n) {
+        auto sent = std::chrono::steady_clock::now();
+        if (!RoundTrip(fd, buffer)) {
+          LOG(ERROR) << "Request failed after " << n << " requests";
+          break;
+        }
+        latencies[i].push_back(std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - sent).count());
+      }
+      close(fd);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const auto &client : latencies) {
+    all.insert(all.end(), client.begin(), client.end());
+  }
+  if (all.empty()) {
+    return;
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) { return all[static_cast<size_t>(p * (all.size() - 1))]; };
+
+  std::cout << std::setw(6) << name << ": " << std::fixed << std::setprecision(1)
+            << all.size() / elapsed << " req/sec, latency (usec) p50 = " << percentile(0.5)
+            << ", p99 = " << percentile(0.99) << ", max = " << all.back() << std::endl;
+}
+
+} // namespace
+
+
+int main(int argc, const char **argv) {
+  google::InitGoogleLogging(argv[0]);
+
+  ::utils::ParseArgs parser(argv, argc);
+  if (parser.has("help")) {
+    usage();
+    return EXIT_SUCCESS;
+  }
+  ::utils::PrintVersion("UDS Benchmark", RELEASE_STR);
+
+  unsigned long requests = parser.getUInt("requests", 100000);
+  unsigned int clients = parser.getUInt("clients", 1);
+  unsigned int port = parser.getUInt("port", kDefaultPort);
+  std::string socket_path = parser.get("socket", kDefaultSocket);
+
+  auto ping = [](const Request &request) { return Response::ok("pong", true); };
+
+  ApiServer tcp(port);
+  tcp.AddGet("ping", ping);
+  tcp.Start();
+
+  ApiServer uds(0);
+  uds.set_unix_socket(socket_path);
+  uds.AddGet("ping", ping);
+  uds.Start();
+
+  Measure("tcp", "", port, requests, clients);
+  Measure("uds", socket_path, 0, requests, clients);
+  return EXIT_SUCCESS;
+}
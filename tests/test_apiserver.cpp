@@ -2,8 +2,22 @@
 // Created by M. Massenzio (marco@alertavert.com) on 7/23/17.
 
 
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <future>
 #include <memory>
 #include <thread>
+#include <vector>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
@@ -167,6 +181,38 @@ TEST_F(ApiServerTest, queryArgs) {
 }
 
 
+TEST_F(ApiServerTest, requestValues) {
+  auto handler = [](const Request &request) -> Response {
+    // Headers looked up by name are case-insensitive.
+    if (request.GetHeader("accept") != "application/json") {
+      return Response::bad_request("Missing header: " + request.GetHeader("accept"));
+    }
+    if (request.query_args().size() != 2 || request.GetQueryArg("flag") != "" ||
+        request.query_args().at("abc") != "test" ||
+        request.headers().count("Accept") == 0) {
+      return Response::bad_request("Missing values");
+    }
+    return Response::ok();
+  };
+  // Routes can be added while the server is running, each with its own option.
+  server_->AddGet("values", handler);
+  server_->AddGet("eager", handler, true);
+
+  for (const auto &resource : {"values", "eager"}) {
+    try {
+      client_.get(std::string{"http://localhost:7999/api/v1/"} + resource + "?abc=test&flag")
+          .on("error", [](request::Error &&err) {
+            FAIL() << "Could not connect to API Server: " << err.message;
+          }).on("response", [this](request::Response &&res) {
+            EXPECT_EQ(200, res.statusCode) << res.str();
+          }).end();
+    } catch (const std::exception &e) {
+      FAIL() << e.what();
+    }
+  }
+}
+
+
 TEST_F(ApiServerTest, setHeaders) {
 
     server_->AddGet("headers", [](const Request &request) {
@@ -226,3 +272,761 @@ TEST_F(ApiServerTest, postContentType) {
 }
 
 
+TEST_F(ApiServerTest, removeHandler) {
+  server_->AddGet("transient", [](const Request &request) {
+    return Response::ok();
+  });
+
+  try {
+    client_.get("http://localhost:7999/api/v1/transient")
+        .on("error", [](request::Error &&err) {
+          FAIL() << "Could not connect to API Server: "
+                 << err.message;
+        }).on("response", [this](request::Response &&res) {
+          ASSERT_EQ(200, res.statusCode);
+        }).end();
+
+    ASSERT_TRUE(server_->RemoveMethodHandler("GET", "transient"));
+    ASSERT_FALSE(server_->RemoveMethodHandler("GET", "transient"));
+
+    client_.get("http://localhost:7999/api/v1/transient")
+        .on("error", [](request::Error &&err) {
+          FAIL() << "Could not connect to API Server: "
+                 << err.message;
+        }).on("response", [this](request::Response &&res) {
+          EXPECT_EQ(404, res.statusCode);
+        }).end();
+  } catch (const std::exception &e) {
+    FAIL() << e.what();
+  }
+}
+
+
+TEST_F(ApiServerTest, expiredDeadlineReturnsGatewayTimeout) {
+  server_->AddGet("slow", [](const Request &request) {
+    while (!request.cancelled()) {
+      std::this_thread::sleep_for(milliseconds(10));
+    }
+    return Response::ok("too late");
+  });
+
+  try {
+    client_.setHeader(kRequestTimeoutHeader, "50");
+    client_.get("http://localhost:7999/api/v1/slow")
+        .on("error", [](request::Error &&err) {
+          FAIL() << "Could not connect to API Server: "
+                 << err.message;
+        }).on("response", [this](request::Response &&res) {
+          EXPECT_EQ(504, res.statusCode);
+        }).end();
+  } catch (const std::exception &e) {
+    FAIL() << e.what();
+  }
+}
+
+
+TEST(CancellationTest, tcpClientDisconnectCancelsRequest) {
+  ApiServer server(7997);
+  // A safety net: the handler gives up at the deadline, if the disconnect goes unnoticed.
+  server.set_request_timeout(milliseconds(5000));
+  std::promise<bool> disconnected;
+  server.AddGet("slow", [&disconnected](const Request &request) {
+    while (!request.cancelled()) {
+      std::this_thread::sleep_for(milliseconds(10));
+    }
+    disconnected.set_value(!request.cancellation_token()->expired());
+    return Response::ok("nobody is listening");
+  });
+  server.Start();
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(7997);
+  auto fd = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(0, connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
+  std::string request{"GET /api/v1/slow HTTP/1.1\r\nHost: localhost\r\n\r\n"};
+  send(fd, request.data(), request.size(), 0);
+  std::this_thread::sleep_for(milliseconds(100));
+  close(fd);
+
+  auto result = disconnected.get_future();
+  ASSERT_EQ(std::future_status::ready, result.wait_for(seconds(10)));
+  EXPECT_TRUE(result.get());
+}
+
+
+namespace {
+
+/** @return a socket connected to the server listening on `path`, or `-1` */
+int UnixSocketConnect(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.data(), path.size());
+  auto len = offsetof(sockaddr_un, sun_path) + path.size();
+  if (path[0] == '@') {
+    addr.sun_path[0] = '\0';
+  } else {
+    ++len;
+  }
+
+  auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), len) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/** Reads from `fd` until `marker` is received, or the connection is closed. */
+std::string ReadUntil(int fd, const std::string &marker) {
+  std::string received;
+  char buffer[1024];
+  ssize_t count;
+  while (received.find(marker) == std::string::npos &&
+      (count = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    received.append(buffer, count);
+  }
+  return received;
+}
+
+/** Sends a single request over a Unix socket, and returns the raw HTTP response. */
+std::string UnixSocketGet(const std::string &path, const std::string &url) {
+  auto fd = UnixSocketConnect(path);
+  if (fd < 0) {
+    return "";
+  }
+  auto request = "GET " + url + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+  send(fd, request.data(), request.size(), 0);
+
+  std::string response;
+  char buffer[1024];
+  ssize_t received;
+  while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, received);
+  }
+  close(fd);
+  return response;
+}
+
+} // namespace
+
+
+TEST(UnixSocketTest, servesRequests) {
+  for (const std::string path : {"/tmp/apiserver-test.sock", "@apiserver-test"}) {
+    {
+      ApiServer server(0);
+      server.set_unix_socket(path);
+      server.AddGet("ping", [](const Request &request) { return Response::ok("pong", true); });
+      server.Start();
+
+      auto response = UnixSocketGet(path, "/api/v1/ping");
+      EXPECT_EQ(0, response.find("HTTP/1.1 200")) << response;
+      EXPECT_NE(std::string::npos, response.find("pong")) << response;
+      EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v1/none").find("404"));
+    }
+    // The socket file is removed when the server stops.
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+  }
+}
+
+
+TEST(UnixSocketTest, replacesOnlyStaleSockets) {
+  const std::string path{"/tmp/apiserver-stale.sock"};
+
+  // Left behind by a server which is gone.
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  auto stale = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_EQ(0, bind(stale, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
+  close(stale);
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.AddGet("ping", [](const Request &request) { return Response::ok("pong", true); });
+  server.Start();
+
+  // The address of a live server is not taken over.
+  ApiServer other(0);
+  other.set_unix_socket(path);
+  ASSERT_THROW(other.Start(), HttpCannotStartError);
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v1/ping").find("pong"));
+}
+
+
+TEST(UnixSocketTest, handedOverSocketIsAlwaysClosed) {
+  // Never started.
+  auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  {
+    ApiServer server(0);
+    server.set_listen_socket(fd);
+  }
+  EXPECT_EQ(-1, fcntl(fd, F_GETFD));
+
+  // Failed to start.
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  {
+    ApiServer server(0);
+    server.set_listen_socket(fd);
+    server.set_unix_socket("/tmp/" + std::string(sizeof(sockaddr_un::sun_path), 'x'));
+    ASSERT_THROW(server.Start(), HttpCannotStartError);
+  }
+  EXPECT_EQ(-1, fcntl(fd, F_GETFD));
+}
+
+
+TEST(SingleFlightTest, keyIgnoresArgumentsOrder) {
+  QueryArgs args{{"b", "2"}, {"a", "1"}};
+  ASSERT_EQ(SingleFlight::Key("item", args), SingleFlight::Key("item", {{"a", "1"}, {"b", "2"}}));
+  ASSERT_NE(SingleFlight::Key("item", args), SingleFlight::Key("item", {{"a", "12"}}));
+  ASSERT_NE(SingleFlight::Key("item", {}), SingleFlight::Key("items", {}));
+}
+
+
+TEST(SingleFlightTest, runsAtMostMaxWorkersCalls) {
+  const int kCalls = 8;
+  auto flights = std::make_shared<SingleFlight>(2);
+
+  std::mutex mutex;
+  int running = 0, most = 0, completed = 0;
+  for (int i = 0; i < kCalls; ++i) {
+    flights->Join(std::to_string(i), nullptr, [&](SharedResponse *result) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        most = std::max(most, ++running);
+      }
+      std::this_thread::sleep_for(milliseconds(20));
+      std::lock_guard<std::mutex> lock(mutex);
+      --running;
+      ++completed;
+    });
+  }
+  flights->Drain();
+  EXPECT_EQ(kCalls, completed);
+  EXPECT_EQ(2, most);
+}
+
+
+TEST(SingleFlightTest, drainWaitsForCallsToBeReleased) {
+  auto flights = std::make_shared<SingleFlight>();
+  auto used = std::make_shared<int>(0);
+  std::weak_ptr<int> released = used;
+
+  // Anything thrown is only logged: the flight completes without a result.
+  auto flight = flights->Join("key", nullptr, [used](SharedResponse *result) { throw 42; });
+  used.reset();
+  flights->Drain();
+  EXPECT_TRUE(released.expired());
+  EXPECT_EQ(nullptr, flight->result.response);
+  EXPECT_EQ(0, flights->in_flight());
+}
+
+
+TEST(SingleFlightTest, coalescesConcurrentRequests) {
+  const std::string path{"@apiserver-single-flight"};
+  std::atomic<int> calls{0};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.AddCoalescedGet("slow", [&calls](const Request &request) {
+    ++calls;
+    std::this_thread::sleep_for(milliseconds(500));
+    return Response::ok("value=" + request.GetQueryArg("key"), true);
+  });
+  server.Start();
+
+  std::vector<std::string> responses(20);
+  std::vector<std::thread> clients;
+  for (size_t i = 0; i < responses.size(); ++i) {
+    clients.emplace_back([&, i]() {
+      // Half the clients send a different key, which is a separate call.
+      auto key = i % 2 == 0 ? "?key=a&x=1" : "?x=1&key=b";
+      responses[i] = UnixSocketGet(path, std::string{"/api/v1/slow"} + key);
+    });
+  }
+  for (auto &client : clients) {
+    client.join();
+  }
+
+  ASSERT_EQ(2, calls);
+  for (size_t i = 0; i < responses.size(); ++i) {
+    EXPECT_EQ(0, responses[i].find("HTTP/1.1 200")) << responses[i];
+    EXPECT_NE(std::string::npos, responses[i].find(i % 2 == 0 ? "value=a" : "value=b"));
+  }
+}
+
+
+TEST(SingleFlightTest, clientDeadlineOnlyAppliesToItsRequest) {
+  const std::string path{"@apiserver-single-flight-deadline"};
+  std::atomic<int> calls{0};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.AddCoalescedGet("slow", [&calls](const Request &request) {
+    ++calls;
+    std::this_thread::sleep_for(milliseconds(300));
+    return Response::ok("done", true);
+  });
+  server.Start();
+
+  // The request starting the call is in a hurry; the one joining it is not.
+  auto hurried = std::async(std::launch::async, [&path]() {
+    auto fd = UnixSocketConnect(path);
+    std::string request{"GET /api/v1/slow HTTP/1.1\r\nHost: localhost\r\n"
+                        "X-Request-Timeout: 100\r\nConnection: close\r\n\r\n"};
+    send(fd, request.data(), request.size(), 0);
+    auto response = ReadUntil(fd, "\r\n\r\n");
+    close(fd);
+    return response;
+  });
+  std::this_thread::sleep_for(milliseconds(50));
+  auto patient = UnixSocketGet(path, "/api/v1/slow");
+
+  ASSERT_EQ(1, calls);
+  EXPECT_EQ(0, patient.find("HTTP/1.1 200")) << patient;
+  EXPECT_NE(std::string::npos, patient.find("done")) << patient;
+  auto response = hurried.get();
+  EXPECT_EQ(0, response.find("HTTP/1.1 504")) << response;
+}
+
+
+TEST(ExternalEventLoopTest, runsOnCallerThread) {
+  const std::string path{"@apiserver-event-loop"};
+  auto loop_thread = std::this_thread::get_id();
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.set_external_event_loop(true);
+  server.AddGet("thread", [loop_thread](const Request &request) {
+    return std::this_thread::get_id() == loop_thread ? Response::ok("same", true) :
+        Response::bad_request("Handler not run on the event loop's thread");
+  });
+  server.Start();
+  ASSERT_GE(server.epoll_fd(), 0);
+
+  auto response = std::async(std::launch::async, [&path]() {
+    return UnixSocketGet(path, "/api/v1/thread");
+  });
+  // Nothing is served, unless the loop runs.
+  while (response.wait_for(milliseconds(0)) != std::future_status::ready) {
+    pollfd pfd{server.epoll_fd(), POLLIN, 0};
+    auto timeout = server.NextTimeout();
+    poll(&pfd, 1, timeout < 0 || timeout > 10 ? 10 : static_cast<int>(timeout));
+    server.RunOnce();
+  }
+  auto result = response.get();
+  EXPECT_EQ(0, result.find("HTTP/1.1 200")) << result;
+  EXPECT_NE(std::string::npos, result.find("same"));
+}
+
+
+TEST(RouteGroupTest, middlewareRunsInOrder) {
+  RouteGroup group("/api/v2", nullptr);
+  std::vector<std::string> calls;
+  group.Use([&calls](const Request &request, const Handler &next) {
+    calls.emplace_back("outer");
+    auto response = next(request);
+    response.AddHeader("X-Outer", "yes");
+    return response;
+  });
+  group.Use([&calls](const Request &request, const Handler &next) {
+    calls.emplace_back("inner");
+    if (request.GetQueryArg("token").empty()) {
+      return Response(401, "UNAUTHORIZED");
+    }
+    return next(request);
+  });
+  Handler handler = [&calls](const Request &request) {
+    calls.emplace_back("handler");
+    return Response::ok();
+  };
+
+  Request request;
+  auto response = group.routes()->Invoke(handler, request);
+  ASSERT_EQ(401, response.status_code());
+  ASSERT_EQ("yes", response.headers().at("X-Outer"));
+  ASSERT_EQ((std::vector<std::string>{"outer", "inner"}), calls);
+
+  calls.clear();
+  request.AddQueryArg("token", "secret");
+  ASSERT_EQ(200, group.routes()->Invoke(handler, request).status_code());
+  ASSERT_EQ((std::vector<std::string>{"outer", "inner", "handler"}), calls);
+}
+
+
+TEST(RouteGroupTest, servesSeveralPrefixes) {
+  const std::string path{"@apiserver-route-groups"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.AddGet("users", [](const Request &request) { return Response::ok("v1", true); });
+  auto v2 = server.AddRouteGroup("/api/v2/");
+  ASSERT_EQ("/api/v2", v2->prefix());
+  ASSERT_EQ(v2, server.AddRouteGroup("api/v2"));
+  v2->AddGet("users", [](const Request &request) { return Response::ok("v2", true); });
+  auto tenant = server.AddRouteGroup("/tenants/acme/api/v1");
+  tenant->Use([](const Request &request, const Handler &next) {
+    auto response = next(request);
+    response.AddHeader("X-Tenant", "acme");
+    return response;
+  });
+  tenant->AddGet("users", [](const Request &request) { return Response::ok("acme", true); });
+  server.Start();
+
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v1/users").find("v1"));
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v1/any/users").find("v1"));
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v2/users").find("v2"));
+  auto response = UnixSocketGet(path, "/tenants/acme/api/v1/users");
+  EXPECT_NE(std::string::npos, response.find("acme")) << response;
+  EXPECT_NE(std::string::npos, response.find("X-Tenant: acme")) << response;
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v2/none").find("Not a valid resource"));
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v10/users").find("Unknown API endpoint"));
+
+  ASSERT_FALSE(server.RemoveRouteGroup(kApiVersionPrefix));
+  ASSERT_TRUE(server.RemoveRouteGroup("/api/v2"));
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v2/users").find("Unknown API endpoint"));
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v1/users").find("v1"));
+}
+
+
+TEST(RouteGroupTest, removedRoutesAreReleased) {
+  ApiServer server(0);
+  auto group = server.AddRouteGroup("/api/v2");
+  std::weak_ptr<EventBroadcaster> stream = group->AddEventStream("events");
+  group->AddCoalescedGet("slow", [](const Request &request) { return Response::ok(); });
+  std::weak_ptr<SingleFlight> flights = group->routes()->coalesced.at("slow");
+
+  // Nothing is in flight, so nothing keeps them once they are removed.
+  ASSERT_TRUE(group->RemoveEventStream("events"));
+  ASSERT_TRUE(group->RemoveMethodHandler("GET", "slow"));
+  EXPECT_TRUE(stream.expired());
+  EXPECT_TRUE(flights.expired());
+
+  std::weak_ptr<RouteGroup> removed = group;
+  group.reset();
+  ASSERT_TRUE(server.RemoveRouteGroup("/api/v2"));
+  EXPECT_TRUE(removed.expired());
+}
+
+
+TEST(RouteGroupTest, enforcesLimits) {
+  const std::string path{"@apiserver-route-limits"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  auto group = server.AddRouteGroup("/api/v2");
+  RouteLimits limits;
+  limits.max_requests = 1;
+  group->set_limits(limits);
+  // Coalesced, so that it does not block the daemon's thread.
+  group->AddCoalescedGet("slow", [](const Request &request) {
+    std::this_thread::sleep_for(milliseconds(300));
+    return Response::ok("done", true);
+  });
+  server.Start();
+
+  auto first = std::async(std::launch::async, [&path]() {
+    return UnixSocketGet(path, "/api/v2/slow");
+  });
+  std::this_thread::sleep_for(milliseconds(100));
+  auto second = UnixSocketGet(path, "/api/v2/slow");
+  EXPECT_EQ(0, second.find("HTTP/1.1 503")) << second;
+  EXPECT_EQ(0, first.get().find("HTTP/1.1 200"));
+
+  // Once the first request completed, there is room for another.
+  EXPECT_EQ(0, UnixSocketGet(path, "/api/v2/slow").find("HTTP/1.1 200"));
+}
+
+
+TEST(WebSocketSessionTest, stopsWhileClientIsNotReading) {
+  const std::string path{"@apiserver-websocket-stalled"};
+  std::atomic<int> sent{0};
+  std::atomic<bool> failed{false};
+
+  auto server = std::make_shared<ApiServer>(0);
+  server->set_unix_socket(path);
+  server->AddWebSocket("flood", [&](WebSocketSession &session, const WebSocketMessage &message) {
+    // Fills the socket buffers, until the client's lack of reading blocks us.
+    std::string chunk(64 * 1024, 'x');
+    while (session.Send(chunk)) {
+      ++sent;
+    }
+    failed = true;
+  });
+  server->Start();
+
+  auto fd = UnixSocketConnect(path);
+  ASSERT_GE(fd, 0);
+  std::string upgrade{"GET /api/v1/flood HTTP/1.1\r\nHost: localhost\r\n"
+                      "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n"};
+  send(fd, upgrade.data(), upgrade.size(), 0);
+  auto response = ReadUntil(fd, "\r\n\r\n");
+  ASSERT_EQ(0, response.find("HTTP/1.1 101")) << response;
+
+  // A masked "go" text frame, after which we stop reading.
+  const char frame[] = {'\x81', '\x82', 1, 2, 3, 4, 'g' ^ 1, 'o' ^ 2};
+  send(fd, frame, sizeof(frame), 0);
+  while (sent == 0) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  std::this_thread::sleep_for(milliseconds(100));
+  ASSERT_FALSE(failed);
+
+  // Stopping the server must not wait for the blocked sender, which fails instead.
+  auto stopped = std::async(std::launch::async, [&server]() { server.reset(); });
+  ASSERT_EQ(std::future_status::ready, stopped.wait_for(seconds(5)));
+  EXPECT_TRUE(failed);
+  close(fd);
+}
+
+
+TEST(RoutesTest, postCompletesIfRemovedDuringUpload) {
+  const std::string path{"@apiserver-post-removed"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.AddPost("upload", [](const Request &request) {
+    return Response::ok("received: " + request.body(), true);
+  });
+  server.Start();
+
+  auto fd = UnixSocketConnect(path);
+  ASSERT_GE(fd, 0);
+  std::string headers{"POST /api/v1/upload HTTP/1.1\r\nHost: localhost\r\n"
+                      "Content-Length: 5\r\nConnection: close\r\n\r\n"};
+  send(fd, headers.data(), headers.size(), 0);
+  std::this_thread::sleep_for(milliseconds(100));
+
+  // The last POST route: new requests would now get a 405.
+  ASSERT_TRUE(server.RemoveMethodHandler("POST", "upload"));
+  send(fd, "hello", 5, 0);
+  auto response = ReadUntil(fd, "hello");
+  EXPECT_EQ(0, response.find("HTTP/1.1 200")) << response;
+  EXPECT_NE(std::string::npos, response.find("received: hello")) << response;
+  close(fd);
+}
+
+
+TEST(RouteGroupTest, changesDoNotAffectRequestsInFlight) {
+  const std::string path{"@apiserver-group-removed"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  auto group = server.AddRouteGroup("/api/v2");
+  group->AddPost("upload", [](const Request &request) {
+    return Response::ok("received: " + request.body(), true);
+  });
+  server.Start();
+
+  auto fd = UnixSocketConnect(path);
+  ASSERT_GE(fd, 0);
+  std::string headers{"POST /api/v2/upload HTTP/1.1\r\nHost: localhost\r\n"
+                      "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n"};
+  send(fd, headers.data(), headers.size(), 0);
+  std::this_thread::sleep_for(milliseconds(100));
+
+  RouteLimits limits;
+  limits.max_body_size = 1;
+  group->set_limits(limits);
+  group->Use([](const Request &request, const Handler &next) {
+    return Response::bad_request("Middleware added mid-request");
+  });
+  ASSERT_TRUE(server.RemoveRouteGroup("/api/v2"));
+
+  std::string body{"5\r\nhello\r\n0\r\n\r\n"};
+  send(fd, body.data(), body.size(), 0);
+  auto response = ReadUntil(fd, "hello");
+  EXPECT_EQ(0, response.find("HTTP/1.1 200")) << response;
+  EXPECT_NE(std::string::npos, response.find("received: hello")) << response;
+  close(fd);
+}
+
+
+TEST(MemoryBudgetTest, chunkedPostIsAccountedForOnce) {
+  const std::string path{"@apiserver-post-budget"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.AddPost("upload", [](const Request &request) {
+    return Response::ok("received: " + request.body(), true);
+  });
+  server.Start();
+
+  auto fd = UnixSocketConnect(path);
+  ASSERT_GE(fd, 0);
+  std::string headers{"POST /api/v1/upload HTTP/1.1\r\nHost: localhost\r\n"
+                      "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n"};
+  send(fd, headers.data(), headers.size(), 0);
+
+  std::string chunk{"400\r\n" + std::string(1024, 'x') + "\r\n"};
+  send(fd, chunk.data(), chunk.size(), 0);
+  std::this_thread::sleep_for(milliseconds(100));
+  auto used = server.memory_budget().used();
+
+  // Each chunk's response replaces the previous one, and so does its reservation.
+  for (int i = 0; i < 10; ++i) {
+    send(fd, chunk.data(), chunk.size(), 0);
+    std::this_thread::sleep_for(milliseconds(20));
+  }
+  std::this_thread::sleep_for(milliseconds(100));
+  EXPECT_EQ(used, server.memory_budget().used());
+
+  std::string last{"0\r\n\r\n"};
+  send(fd, last.data(), last.size(), 0);
+  auto response = ReadUntil(fd, "received: ");
+  EXPECT_EQ(0, response.find("HTTP/1.1 200")) << response;
+  close(fd);
+}
+
+
+namespace {
+
+/** Subscribes to the event stream at `url`, either via SSE, or long-poll. */
+int Subscribe(const std::string &path, const std::string &url, bool long_poll) {
+  auto fd = UnixSocketConnect(path);
+  if (fd < 0) {
+    return fd;
+  }
+  auto request = "GET " + url + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n";
+  if (!long_poll) {
+    request += "Accept: text/event-stream\r\n";
+  }
+  request += "\r\n";
+  send(fd, request.data(), request.size(), 0);
+  return fd;
+}
+
+/** Waits (up to `timeout`) until `broadcaster` has `count` subscribers. */
+bool WaitForSubscribers(EventBroadcaster &broadcaster, size_t count,
+                        milliseconds timeout = milliseconds(5000)) {
+  auto deadline = steady_clock::now() + timeout;
+  while (broadcaster.subscribers_count() != count && steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  return broadcaster.subscribers_count() == count;
+}
+
+} // namespace
+
+
+TEST(EventStreamServerTest, sseClientReceivesEvents) {
+  const std::string path{"@apiserver-sse"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  auto events = server.AddEventStream("events");
+  server.Start();
+
+  auto fd = Subscribe(path, "/api/v1/events", false);
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(WaitForSubscribers(*events, 1));
+
+  ASSERT_EQ(1, events->Publish("first", "update"));
+  auto received = ReadUntil(fd, "data: first\n\n");
+  EXPECT_EQ(0, received.find("HTTP/1.1 200")) << received;
+  EXPECT_NE(std::string::npos, received.find("text/event-stream")) << received;
+  EXPECT_NE(std::string::npos, received.find("event: update\ndata: first\n\n")) << received;
+
+  // The stream stays open for the events that follow.
+  ASSERT_EQ(1, events->Publish("second"));
+  received = ReadUntil(fd, "data: second\n\n");
+  EXPECT_NE(std::string::npos, received.find("data: second\n\n")) << received;
+  close(fd);
+}
+
+
+TEST(EventStreamServerTest, longPollClientReceivesNextEvent) {
+  const std::string path{"@apiserver-long-poll"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  auto events = server.AddEventStream("events");
+  server.Start();
+
+  auto fd = Subscribe(path, "/api/v1/events", true);
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(WaitForSubscribers(*events, 1));
+
+  ASSERT_EQ(1, events->Publish("only"));
+  // The response ends after the first event, and the connection is closed.
+  auto received = ReadUntil(fd, "no marker: read until closed");
+  EXPECT_EQ(0, received.find("HTTP/1.1 200")) << received;
+  EXPECT_NE(std::string::npos, received.find("data: only\n\n")) << received;
+  close(fd);
+  ASSERT_TRUE(WaitForSubscribers(*events, 0));
+}
+
+
+TEST(EventStreamServerTest, servesManyIdleSubscribers) {
+  const std::string path{"@apiserver-many-subscribers"};
+  const size_t kSubscribers = 10000;
+
+  // Both ends of each connection are in this process.
+  rlimit files{};
+  ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &files));
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+  ASSERT_GE(files.rlim_cur, 2 * kSubscribers + 100)
+      << "Raise the hard limit on open files (ulimit -Hn) to run this test";
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.set_connection_limit(kSubscribers + 10);
+  server.set_connection_memory_limit(8 * 1024);
+  auto events = server.AddEventStream("events");
+  server.Start();
+
+  std::vector<int> fds;
+  for (size_t i = 0; i < kSubscribers; ++i) {
+    auto fd = Subscribe(path, "/api/v1/events", i % 2 == 0);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+  }
+  ASSERT_TRUE(WaitForSubscribers(*events, kSubscribers, milliseconds(30000)));
+
+  // Idle subscribers are suspended: the server still serves other requests.
+  server.AddGet("ping", [](const Request &request) { return Response::ok("pong", true); });
+  EXPECT_NE(std::string::npos, UnixSocketGet(path, "/api/v1/ping").find("pong"));
+
+  ASSERT_EQ(kSubscribers, events->Publish("broadcast"));
+  for (auto fd : fds) {
+    auto received = ReadUntil(fd, "data: broadcast\n\n");
+    EXPECT_NE(std::string::npos, received.find("data: broadcast\n\n")) << received;
+    close(fd);
+  }
+}
+
+
+TEST(EventStreamServerTest, heartbeatReapsDisconnectedSubscribers) {
+  const std::string path{"@apiserver-heartbeat"};
+
+  ApiServer server(0);
+  server.set_unix_socket(path);
+  server.set_heartbeat_interval(milliseconds(50));
+  auto events = server.AddEventStream("events");
+  RouteLimits limits;
+  limits.max_requests = 1;
+  server.AddRouteGroup(kApiVersionPrefix)->set_limits(limits);
+  server.Start();
+
+  auto alive = Subscribe(path, "/api/v1/events", false);
+  ASSERT_GE(alive, 0);
+  ASSERT_TRUE(WaitForSubscribers(*events, 1));
+  auto received = ReadUntil(alive, ":\n\n");
+  EXPECT_NE(std::string::npos, received.find(":\n\n")) << received;
+  close(alive);
+
+  // Nothing is published: the heartbeat alone finds out the client is gone, and releases
+  // its slot.
+  ASSERT_TRUE(WaitForSubscribers(*events, 0));
+  auto next = Subscribe(path, "/api/v1/events", true);
+  ASSERT_GE(next, 0);
+  ASSERT_TRUE(WaitForSubscribers(*events, 1));
+  events->Publish("welcome");
+  EXPECT_NE(std::string::npos, ReadUntil(next, "data: welcome").find("data: welcome"));
+  close(next);
+}
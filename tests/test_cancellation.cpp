@@ -0,0 +1,117 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/23/20.
+
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/ApiServer.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+using namespace std::chrono;
+
+
+TEST(CancellationTokenTest, noDeadline) {
+  CancellationToken token;
+  ASSERT_FALSE(token.expired());
+  ASSERT_FALSE(token.cancelled());
+  ASSERT_GT(token.remaining(), hours(24));
+}
+
+
+TEST(CancellationTokenTest, deadlineExpires) {
+  CancellationToken token(steady_clock::now() + milliseconds(50));
+  int called = 0;
+  token.OnCancel([&called]() { ++called; });
+
+  ASSERT_FALSE(token.cancelled());
+  ASSERT_GT(token.remaining(), milliseconds(0));
+
+  ASSERT_TRUE(tests::WaitAtMostFor([&token]() { return token.cancelled(); },
+                                   milliseconds(500), milliseconds(20)));
+  ASSERT_TRUE(token.expired());
+  ASSERT_EQ(milliseconds(0), token.remaining());
+  ASSERT_EQ(1, called);
+}
+
+
+TEST(CancellationTokenTest, callbacksRunOnce) {
+  CancellationToken token;
+  int called = 0;
+  token.OnCancel([&called]() { ++called; });
+  token.OnCancel([&called]() { ++called; });
+
+  token.Cancel();
+  token.Cancel();
+  ASSERT_TRUE(token.cancelled());
+  ASSERT_EQ(2, called);
+
+  // Registering after cancellation runs the callback right away.
+  token.OnCancel([&called]() { ++called; });
+  ASSERT_EQ(3, called);
+}
+
+
+TEST(CancellationTokenTest, detectsClientDisconnect) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  CancellationToken token(steady_clock::time_point::max(), fds[0]);
+  ASSERT_FALSE(token.cancelled());
+
+  // Pending data (e.g., a pipelined request) does not count as a disconnect.
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  ASSERT_FALSE(token.cancelled());
+
+  close(fds[1]);
+  char byte;
+  ASSERT_EQ(1, read(fds[0], &byte, 1));
+  ASSERT_TRUE(token.cancelled());
+  close(fds[0]);
+}
+
+
+TEST(CancellationTokenTest, detectsTcpClientDisconnect) {
+  // Unlike a Unix socket, a TCP connection closed by the client raises no POLLHUP.
+  auto listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr *>(&addr), len));
+  ASSERT_EQ(0, listen(listener, 1));
+  ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len));
+
+  auto client = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(0, connect(client, reinterpret_cast<sockaddr *>(&addr), len));
+  auto server = accept(listener, nullptr, nullptr);
+  ASSERT_GE(server, 0);
+
+  CancellationToken token(steady_clock::time_point::max(), server);
+  ASSERT_EQ(1, write(client, "x", 1));
+  ASSERT_FALSE(token.cancelled());
+
+  close(client);
+  char byte;
+  ASSERT_EQ(1, read(server, &byte, 1));
+  ASSERT_TRUE(tests::WaitAtMostFor([&token]() { return token.cancelled(); },
+                                   milliseconds(500), milliseconds(10)));
+  close(server);
+  close(listener);
+}
+
+
+TEST(CancellationTokenTest, requestWithoutToken) {
+  Request request;
+  ASSERT_EQ(nullptr, request.cancellation_token());
+  ASSERT_FALSE(request.cancelled());
+
+  request.set_cancellation_token(std::make_shared<CancellationToken>());
+  request.cancellation_token()->Cancel();
+  ASSERT_TRUE(request.cancelled());
+}
@@ -0,0 +1,219 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/2/20.
+
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/EventStream.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+
+
+namespace {
+
+std::string ReadAll(EventSubscriber &subscriber, size_t block_size = 16) {
+  std::string result;
+  std::vector<char> buf(block_size);
+  ssize_t count;
+  while ((count = subscriber.Read(buf.data(), buf.size())) > 0) {
+    result.append(buf.data(), count);
+  }
+  return result;
+}
+
+} // namespace
+
+
+TEST(EventStreamTest, formatEvent) {
+  ASSERT_EQ("data: hello\n\n", EventBroadcaster::FormatEvent("hello"));
+  ASSERT_EQ("id: 42\nevent: update\ndata: {\"a\": 1}\n\n",
+            EventBroadcaster::FormatEvent("{\"a\": 1}", "update", "42"));
+  ASSERT_EQ("data: one\ndata: two\n\n", EventBroadcaster::FormatEvent("one\ntwo"));
+  ASSERT_EQ("data: \n\n", EventBroadcaster::FormatEvent(""));
+}
+
+
+TEST(EventStreamTest, subscriberReceivesEvents) {
+  EventBroadcaster broadcaster("events");
+  auto subscriber = broadcaster.Subscribe(nullptr);
+
+  ASSERT_EQ(1, broadcaster.Publish("first"));
+  ASSERT_EQ(1, broadcaster.Publish("second", "update"));
+
+  // Reading with a small buffer must still reassemble the events correctly.
+  ASSERT_EQ("data: first\n\nevent: update\ndata: second\n\n", ReadAll(*subscriber, 5));
+
+  // Nothing pending, but the stream is still open.
+  char buf[16];
+  ASSERT_EQ(0, subscriber->Read(buf, sizeof(buf)));
+}
+
+
+TEST(EventStreamTest, closeEndsStream) {
+  EventBroadcaster broadcaster("events");
+  auto subscriber = broadcaster.Subscribe(nullptr);
+
+  broadcaster.Publish("last");
+  broadcaster.Close();
+  ASSERT_EQ(0, broadcaster.Publish("too late"));
+
+  // Events queued before closing are still delivered.
+  ASSERT_EQ("data: last\n\n", ReadAll(*subscriber));
+  char buf[16];
+  ASSERT_EQ(MHD_CONTENT_READER_END_OF_STREAM, subscriber->Read(buf, sizeof(buf)));
+
+  auto late = broadcaster.Subscribe(nullptr);
+  ASSERT_TRUE(late->closed());
+}
+
+
+TEST(EventStreamTest, longPollEndsAfterFirstEvent) {
+  EventBroadcaster broadcaster("events");
+  auto subscriber = broadcaster.Subscribe(nullptr, true);
+
+  char buf[64];
+  ASSERT_EQ(0, subscriber->Read(buf, sizeof(buf)));
+
+  broadcaster.Publish("ping");
+  ASSERT_EQ("data: ping\n\n", ReadAll(*subscriber));
+  ASSERT_EQ(MHD_CONTENT_READER_END_OF_STREAM, subscriber->Read(buf, sizeof(buf)));
+}
+
+
+TEST(EventStreamTest, slowSubscriberIsDisconnected) {
+  EventBroadcaster broadcaster("events");
+  broadcaster.set_max_pending(2);
+  auto slow = broadcaster.Subscribe(nullptr);
+
+  ASSERT_EQ(1, broadcaster.Publish("one"));
+  ASSERT_EQ(1, broadcaster.Publish("two"));
+  ASSERT_EQ(0, broadcaster.Publish("three"));
+  ASSERT_TRUE(slow->closed());
+}
+
+
+TEST(EventStreamTest, unsubscribe) {
+  EventBroadcaster broadcaster("events");
+  auto subscriber = broadcaster.Subscribe(nullptr);
+  ASSERT_EQ(1, broadcaster.subscribers_count());
+
+  broadcaster.Unsubscribe(subscriber.get());
+  ASSERT_EQ(0, broadcaster.subscribers_count());
+  ASSERT_EQ(0, broadcaster.Publish("nobody listens"));
+}
+
+
+TEST(EventStreamTest, fanOutToManySubscribers) {
+  const size_t kSubscribers = 10000;
+  const int kEvents = 10;
+
+  EventBroadcaster broadcaster("events");
+  std::vector<std::shared_ptr<EventSubscriber>> subscribers;
+  subscribers.reserve(kSubscribers);
+  for (size_t i = 0; i < kSubscribers; ++i) {
+    subscribers.push_back(broadcaster.Subscribe(nullptr));
+  }
+  ASSERT_EQ(kSubscribers, broadcaster.subscribers_count());
+
+  std::string expected;
+  for (int i = 0; i < kEvents; ++i) {
+    auto data = "event #" + std::to_string(i);
+    ASSERT_EQ(kSubscribers, broadcaster.Publish(data, "", std::to_string(i)));
+    expected += EventBroadcaster::FormatEvent(data, "", std::to_string(i));
+  }
+
+  for (auto &subscriber : subscribers) {
+    ASSERT_EQ(kEvents, subscriber->pending());
+    ASSERT_EQ(expected, ReadAll(*subscriber, 4096));
+  }
+}
+
+
+TEST(EventStreamTest, backlogIsAccountedForInBudget) {
+  MemoryBudget budget;
+  EventBroadcaster broadcaster("events", &budget);
+  auto first = broadcaster.Subscribe(nullptr);
+  auto second = broadcaster.Subscribe(nullptr);
+
+  auto event = EventBroadcaster::FormatEvent("update");
+  ASSERT_EQ(2, broadcaster.Publish("update"));
+  // The buffer is shared, but each subscriber queues its own reference to it.
+  ASSERT_EQ(event.size() + 2 * sizeof(EventBuffer), budget.used());
+
+  ASSERT_EQ(event, ReadAll(*first));
+  ASSERT_EQ(event.size() + sizeof(EventBuffer), budget.used());
+  ASSERT_EQ(event, ReadAll(*second));
+  ASSERT_EQ(0, budget.used());
+
+  // Whatever is still queued is released with the subscriber.
+  broadcaster.Publish("never read");
+  ASSERT_LT(0, budget.used());
+  broadcaster.Unsubscribe(first.get());
+  broadcaster.Unsubscribe(second.get());
+  first.reset();
+  second.reset();
+  ASSERT_EQ(0, budget.used());
+}
+
+
+TEST(EventStreamTest, subscriberIsDisconnectedWhenBudgetIsExhausted) {
+  auto event = EventBroadcaster::FormatEvent("update");
+  // Room for one event, queued for one subscriber only.
+  MemoryBudget budget(event.size() + sizeof(EventBuffer));
+  EventBroadcaster broadcaster("events", &budget);
+  auto first = broadcaster.Subscribe(nullptr);
+  auto second = broadcaster.Subscribe(nullptr);
+
+  ASSERT_EQ(1, broadcaster.Publish("update"));
+  ASSERT_NE(first->closed(), second->closed());
+
+  // Until it is delivered, there is no room for another event.
+  auto open = first->closed() ? second : first;
+  ASSERT_EQ(0, broadcaster.Publish("update"));
+  ASSERT_FALSE(open->closed());
+  ASSERT_EQ(event, ReadAll(*open));
+  ASSERT_EQ(1, broadcaster.Publish("update"));
+}
+
+
+TEST(EventStreamTest, connectionKeepsBroadcasterAlive) {
+  auto broadcaster = std::make_shared<EventBroadcaster>("events");
+  std::weak_ptr<EventBroadcaster> removed = broadcaster;
+
+  // Never dereferenced: nothing is published, nor read.
+  int fake;
+  auto connection = reinterpret_cast<struct MHD_Connection *>(&fake);
+  auto subscriber = broadcaster->Subscribe(connection);
+  broadcaster.reset();
+  ASSERT_FALSE(removed.expired());
+
+  // Once libmicrohttpd is done with the response, nothing else keeps it.
+  EventSubscriber::ContentReaderFreeCallback(subscriber.get());
+  subscriber.reset();
+  ASSERT_TRUE(removed.expired());
+}
+
+
+TEST(EventStreamTest, heartbeatIsOnlySentToIdleSubscribers) {
+  EventBroadcaster broadcaster("events");
+  auto busy = broadcaster.Subscribe(nullptr);
+  broadcaster.Publish("pending");
+  auto idle = broadcaster.Subscribe(nullptr, true);
+
+  ASSERT_EQ(2, broadcaster.Heartbeat());
+  ASSERT_EQ(1, idle->pending());
+  ASSERT_EQ(1, busy->pending());
+
+  // A heartbeat does not end a long-poll response: only an event does.
+  char buf[16];
+  ASSERT_EQ(":\n\n", ReadAll(*idle));
+  ASSERT_EQ(0, idle->Read(buf, sizeof(buf)));
+  broadcaster.Publish("event");
+  ASSERT_EQ("data: event\n\n", ReadAll(*idle));
+  ASSERT_EQ(MHD_CONTENT_READER_END_OF_STREAM, idle->Read(buf, sizeof(buf)));
+}
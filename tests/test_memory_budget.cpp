@@ -0,0 +1,143 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/27/20.
+
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/MemoryBudget.hpp"
+#include "api/rest/SingleFlight.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+
+
+TEST(MemoryBudgetTest, reservesWithinLimit) {
+  MemoryBudget budget(1000);
+
+  ASSERT_TRUE(budget.Reserve(600));
+  ASSERT_TRUE(budget.Fits(400));
+  ASSERT_FALSE(budget.Reserve(401));
+  ASSERT_EQ(1, budget.rejected());
+  ASSERT_EQ(600, budget.used());
+
+  ASSERT_TRUE(budget.Reserve(400));
+  budget.Release(1000);
+  ASSERT_EQ(0, budget.used());
+  ASSERT_EQ(1000, budget.peak());
+
+  // Memory already in use is accounted for, even if over budget.
+  budget.ForceReserve(1500);
+  ASSERT_EQ(1500, budget.used());
+  ASSERT_FALSE(budget.Fits(0));
+  budget.Release(1500);
+}
+
+
+TEST(MemoryBudgetTest, hugeReservationsDoNotOverflow) {
+  MemoryBudget budget(1000);
+  ASSERT_TRUE(budget.Reserve(600));
+  ASSERT_FALSE(budget.Fits(SIZE_MAX - 1));
+  ASSERT_FALSE(budget.Reserve(SIZE_MAX - 1));
+  ASSERT_FALSE(budget.Reserve(SIZE_MAX));
+  ASSERT_EQ(600, budget.used());
+
+  MemoryBudget unlimited;
+  ASSERT_TRUE(unlimited.Reserve(600));
+  ASSERT_FALSE(unlimited.Reserve(SIZE_MAX - 1));
+  ASSERT_EQ(600, unlimited.used());
+}
+
+
+TEST(MemoryBudgetTest, unlimited) {
+  MemoryBudget budget;
+  ASSERT_TRUE(budget.Reserve(1UL << 40));
+  ASSERT_EQ(1UL << 40, budget.used());
+
+  budget.set_limit(100);
+  ASSERT_FALSE(budget.Reserve(1));
+}
+
+
+TEST(MemoryBudgetTest, concurrentReservations) {
+  MemoryBudget budget(10000);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&budget]() {
+      for (int j = 0; j < 10000; ++j) {
+        if (budget.Reserve(10)) {
+          budget.Release(10);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(0, budget.used());
+  ASSERT_LE(budget.peak(), 10000);
+}
+
+
+TEST(BufferPoolTest, recyclesBuffers) {
+  MemoryBudget budget;
+  BufferPool pool(&budget, 1024, 4);
+
+  char *data;
+  {
+    auto buffer = pool.Acquire();
+    ASSERT_TRUE(buffer);
+    ASSERT_EQ(1024, buffer.size());
+    data = buffer.data();
+    ASSERT_EQ(4 * 1024, pool.allocated());
+    ASSERT_EQ(4 * 1024, budget.used());
+    ASSERT_EQ(3, pool.available());
+  }
+  ASSERT_EQ(4, pool.available());
+  ASSERT_EQ(data, pool.Acquire().data());
+
+  std::vector<BufferPool::Buffer> buffers;
+  for (int i = 0; i < 5; ++i) {
+    buffers.push_back(pool.Acquire());
+  }
+  // A second slab was needed.
+  ASSERT_EQ(8 * 1024, budget.used());
+  ASSERT_EQ(3, pool.available());
+}
+
+
+TEST(BufferPoolTest, respectsBudget) {
+  MemoryBudget budget(2 * 1024);
+  {
+    BufferPool pool(&budget, 1024, 2);
+    auto first = pool.Acquire();
+    auto second = pool.Acquire();
+    ASSERT_TRUE(first && second);
+
+    auto third = pool.Acquire();
+    ASSERT_FALSE(third);
+    ASSERT_EQ(nullptr, third.data());
+    ASSERT_EQ(0, third.size());
+
+    second = BufferPool::Buffer{};
+    ASSERT_TRUE(pool.Acquire());
+  }
+  // Slabs are released with the pool.
+  ASSERT_EQ(0, budget.used());
+}
+
+
+TEST(MemoryBudgetTest, sharedResponseReleasesItsBody) {
+  MemoryBudget budget;
+  ASSERT_TRUE(budget.Reserve(1024));
+  {
+    SharedResponse response;
+    response.budget = &budget;
+    response.reserved = 1024;
+  }
+  ASSERT_EQ(0, budget.used());
+}
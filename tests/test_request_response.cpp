@@ -53,6 +53,20 @@ TEST(TestRequestResponse, testQueryArgs) {
 }
 
 
+TEST(TestRequestResponse, testUnboundRequestValues) {
+  Request request;
+  request.AddHeader("x-foo", "bar");
+  request.AddQueryArg("page", "2");
+
+  const Request &req = request;
+  ASSERT_EQ("bar", req.GetHeader("x-foo"));
+  ASSERT_EQ("", req.GetHeader("x-bar"));
+  ASSERT_EQ(kApplicationJson, req.GetHeader(MHD_HTTP_HEADER_CONTENT_TYPE));
+  ASSERT_EQ(2, req.headers().size());
+  ASSERT_EQ(1, req.query_args().size());
+}
+
+
 TEST(TestRequestResponse, testCopyConstructor) {
   auto response = Response::created("/res/id/4999");
   response.AddHeader("Content-Type", "text/plain");
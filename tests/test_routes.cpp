@@ -0,0 +1,215 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/16/20.
+
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/ApiServer.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+
+
+TEST(RouterTest, updatesAreNotVisibleToExistingSnapshots) {
+  Router router;
+  router.Update([](RouteTable *routes) {
+    routes->handlers["GET"]["test"] = [](const Request &) { return Response::ok(); };
+  });
+
+  auto before = router.routes();
+  router.Update([](RouteTable *routes) {
+    routes->handlers["GET"].erase("test");
+    routes->handlers["POST"]["test"] = [](const Request &) { return Response::created("/"); };
+  });
+  auto after = router.routes();
+
+  ASSERT_NE(nullptr, before->FindHandler("GET", "test"));
+  ASSERT_EQ(nullptr, before->FindHandler("POST", "test"));
+  ASSERT_FALSE(before->HasMethod("POST"));
+
+  ASSERT_EQ(nullptr, after->FindHandler("GET", "test"));
+  ASSERT_NE(nullptr, after->FindHandler("POST", "test"));
+  ASSERT_EQ(201, (*after->FindHandler("POST", "test"))(Request{}).status_code());
+}
+
+
+/**
+ * Readers continuously route requests while writers add and remove routes: run the
+ * tests built with `-DSANITIZE_THREAD=ON` to have ThreadSanitizer verify there are no
+ * data races.
+ */
+TEST(RouterTest, concurrentReadersAndWriters) {
+  const int kReaders = 8;
+  const int kWriters = 2;
+  const int kUpdates = 500;
+
+  Router router;
+  router.Update([](RouteTable *routes) {
+    routes->handlers["GET"]["stable"] = [](const Request &) { return Response::ok(); };
+  });
+
+  std::atomic<bool> done(false);
+  std::atomic<long> routed(0);
+  std::atomic<long> missing(0);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kReaders; ++i) {
+    threads.emplace_back([&]() {
+      while (!done) {
+        auto routes = router.routes();
+        auto handler = routes->FindHandler("GET", "stable");
+        if (handler == nullptr || (*handler)(Request{}).status_code() != 200) {
+          ++missing;
+        }
+        // Dynamic routes may or may not be there, but if found must be callable.
+        auto dynamic = routes->FindHandler("GET", "dynamic-0");
+        if (dynamic != nullptr) {
+          (*dynamic)(Request{});
+        }
+        ++routed;
+      }
+    });
+  }
+
+  std::vector<std::thread> writers;
+  for (int w = 0; w < kWriters; ++w) {
+    writers.emplace_back([&router, w]() {
+      for (int i = 0; i < kUpdates; ++i) {
+        auto resource = "dynamic-" + std::to_string(i % 10);
+        router.Update([&](RouteTable *routes) {
+          if ((i + w) % 2 == 0) {
+            routes->handlers["GET"][resource] = [](const Request &) { return Response::ok(); };
+          } else {
+            routes->handlers["GET"].erase(resource);
+          }
+        });
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  done = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_GT(routed.load(), 0);
+  ASSERT_EQ(0, missing.load());
+  ASSERT_NE(nullptr, router.routes()->FindHandler("GET", "stable"));
+}
+
+
+TEST(PublishedTest, readersSeeReplacedValues) {
+  Published<int> published(std::make_shared<const int>(1));
+  std::weak_ptr<const int> first = published.get();
+  ASSERT_EQ(1, *published.get());
+
+  published.set(std::make_shared<const int>(2));
+  ASSERT_EQ(2, *published.get());
+  // Only this thread had read it.
+  ASSERT_TRUE(first.expired());
+
+  // Another thread keeps its reference until it reads again.
+  std::weak_ptr<const int> second = published.get();
+  std::atomic<int> step(0);
+  std::thread reader([&]() {
+    EXPECT_EQ(2, *published.get());
+    step = 1;
+    while (step != 2) {
+      std::this_thread::yield();
+    }
+    EXPECT_EQ(3, *published.get());
+  });
+  while (step != 1) {
+    std::this_thread::yield();
+  }
+  published.set(std::make_shared<const int>(3));
+  ASSERT_FALSE(second.expired());
+  step = 2;
+  reader.join();
+  ASSERT_TRUE(second.expired());
+}
+
+
+TEST(PublishedTest, valuesAreReleasedWithTheirOwner) {
+  std::weak_ptr<const int> released;
+  {
+    Published<int> published(std::make_shared<const int>(1));
+    released = published.get();
+  }
+  // Dropped from this thread's cache, next time it is used.
+  Published<int> other(std::make_shared<const int>(2));
+  ASSERT_EQ(2, *other.get());
+  ASSERT_TRUE(released.expired());
+}
+
+
+namespace {
+
+// Counts the allocations made by the current thread, see `middlewareDoesNotAllocate`.
+thread_local size_t allocations = 0;
+
+} // namespace
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (auto ptr = malloc(size > 0 ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+
+TEST(RouteTableTest, eagerValuesAreSetPerRoute) {
+  RouteGroup group("/api/v1", nullptr);
+  auto handler = [](const Request &request) { return Response::ok(); };
+  group.AddGet("lazy", handler);
+  group.AddGet("eager", handler, true);
+  group.AddPost("eager", handler);
+
+  auto routes = group.routes();
+  EXPECT_FALSE(routes->EagerValues("GET", "lazy"));
+  EXPECT_TRUE(routes->EagerValues("GET", "eager"));
+  EXPECT_FALSE(routes->EagerValues("POST", "eager"));
+
+  // Replacing or removing a handler also replaces or removes its option.
+  group.AddGet("eager", handler);
+  EXPECT_FALSE(group.routes()->EagerValues("GET", "eager"));
+  group.AddGet("lazy", handler, true);
+  ASSERT_TRUE(group.RemoveMethodHandler("GET", "lazy"));
+  EXPECT_TRUE(group.routes()->eager_values.empty());
+}
+
+
+TEST(RouteTableTest, middlewareDoesNotAllocate) {
+  auto handler = [](const Request &request) { return Response(204, "NO_CONTENT"); };
+  Request request;
+
+  RouteTable routes;
+  auto counted = [&]() {
+    auto before = allocations;
+    EXPECT_EQ(204, routes.Invoke(handler, request).status_code());
+    return allocations - before;
+  };
+  auto bare = counted();
+
+  for (int i = 0; i < 2; ++i) {
+    routes.middleware.emplace_back([](const Request &req, const Handler &next) {
+      return next(req);
+    });
+  }
+  ASSERT_EQ(bare, counted());
+}
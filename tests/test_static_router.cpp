@@ -0,0 +1,137 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/30/20.
+
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/StaticRouter.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+
+
+namespace {
+
+constexpr auto kRoutes = MakeStaticRouter(
+    StaticGet("status", [](const Request &request) {
+      return Response::ok("up");
+    }),
+    StaticGet("query", [](const Request &request) {
+      return Response::ok(request.GetQueryArg("q"));
+    }),
+    StaticPost("status", [](const Request &request) {
+      return Response::created("/status/" + request.body());
+    }),
+    StaticPut("entity", [](const Request &request) {
+      return Response::ok();
+    }),
+    StaticDelete("entity", [](const Request &request) {
+      return Response::not_found();
+    }));
+
+// A larger table, to exercise the perfect hash search.
+constexpr auto kHandler = [](const Request &request) { return Response::ok(); };
+constexpr auto kManyRoutes = MakeStaticRouter(
+    StaticGet("a", kHandler), StaticGet("b", kHandler), StaticGet("c", kHandler),
+    StaticGet("d", kHandler), StaticGet("e", kHandler), StaticGet("f", kHandler),
+    StaticGet("g", kHandler), StaticGet("h", kHandler), StaticGet("users", kHandler),
+    StaticGet("orders", kHandler), StaticGet("items", kHandler), StaticGet("carts", kHandler),
+    StaticPost("a", kHandler), StaticPost("b", kHandler), StaticPost("c", kHandler),
+    StaticPost("users", kHandler), StaticPost("orders", kHandler), StaticPost("items", kHandler),
+    StaticPut("users", kHandler), StaticDelete("users", kHandler));
+
+// Ten routes, for resources `{prefix}0` to `{prefix}9`.
+#define TEN_ROUTES(prefix) \
+    StaticGet(prefix "0", kHandler), StaticGet(prefix "1", kHandler), \
+    StaticGet(prefix "2", kHandler), StaticGet(prefix "3", kHandler), \
+    StaticGet(prefix "4", kHandler), StaticGet(prefix "5", kHandler), \
+    StaticGet(prefix "6", kHandler), StaticGet(prefix "7", kHandler), \
+    StaticGet(prefix "8", kHandler), StaticGet(prefix "9", kHandler)
+
+// Large tables must still be built within the compiler's constexpr evaluation limits.
+constexpr auto kHundredRoutes = MakeStaticRouter(
+    TEN_ROUTES("users/"), TEN_ROUTES("orders/"), TEN_ROUTES("items/"), TEN_ROUTES("carts/"),
+    TEN_ROUTES("a"), TEN_ROUTES("b"), TEN_ROUTES("c"), TEN_ROUTES("d"), TEN_ROUTES("e"),
+    TEN_ROUTES("f"));
+
+#undef TEN_ROUTES
+
+} // namespace
+
+
+TEST(StaticRouterTest, findsRoutes) {
+  ASSERT_EQ(5, kRoutes.size());
+
+  auto index = kRoutes.Find("GET", "status");
+  ASSERT_GE(index, 0);
+  ASSERT_EQ("up", kRoutes.Invoke(index, Request{}).body());
+
+  index = kRoutes.Find("POST", "status");
+  ASSERT_GE(index, 0);
+  auto response = kRoutes.Invoke(index, Request{"1234"});
+  ASSERT_EQ(201, response.status_code());
+  ASSERT_EQ("/status/1234", response.GetHeader("Location"));
+
+  Request request;
+  request.AddQueryArg("q", "answer");
+  ASSERT_EQ("answer", kRoutes.Invoke(kRoutes.Find("GET", "query"), request).body());
+
+  ASSERT_EQ(404, kRoutes.Invoke(kRoutes.Find("DELETE", "entity"), Request{}).status_code());
+}
+
+
+TEST(StaticRouterTest, missingRoutes) {
+  ASSERT_EQ(-1, kRoutes.Find("GET", "entity"));
+  ASSERT_EQ(-1, kRoutes.Find("PATCH", "status"));
+  ASSERT_EQ(-1, kRoutes.Find("GET", "statu"));
+  ASSERT_EQ(-1, kRoutes.Find("GET", ""));
+
+  ASSERT_TRUE(kRoutes.HasMethod("PUT"));
+  ASSERT_FALSE(kRoutes.HasMethod("PATCH"));
+}
+
+
+TEST(StaticRouterTest, allRoutesAreDistinct) {
+  std::vector<int> seen;
+  kManyRoutes.ForEach([&seen](const std::string &method, const std::string &resource) {
+    auto index = kManyRoutes.Find(method, resource);
+    ASSERT_GE(index, 0) << method << " " << resource;
+    seen.push_back(index);
+  });
+  ASSERT_EQ(kManyRoutes.size(), seen.size());
+  std::sort(seen.begin(), seen.end());
+  ASSERT_EQ(seen.end(), std::unique(seen.begin(), seen.end()));
+}
+
+
+TEST(StaticRouterTest, hundredRoutes) {
+  ASSERT_EQ(100, kHundredRoutes.size());
+  std::vector<int> seen;
+  kHundredRoutes.ForEach([&seen](const std::string &method, const std::string &resource) {
+    auto index = kHundredRoutes.Find(method, resource);
+    ASSERT_GE(index, 0) << method << " " << resource;
+    seen.push_back(index);
+  });
+  std::sort(seen.begin(), seen.end());
+  ASSERT_EQ(seen.end(), std::unique(seen.begin(), seen.end()));
+
+  ASSERT_EQ(-1, kHundredRoutes.Find("GET", "users/10"));
+  ASSERT_EQ(-1, kHundredRoutes.Find("POST", "users/1"));
+}
+
+
+TEST(StaticRouterTest, runtimeConstruction) {
+  // Routers need not be constexpr: the table is then built when first constructed.
+  int count = 0;
+  auto router = MakeStaticRouter(StaticGet("count", [&count](const Request &) {
+    ++count;
+    return Response::ok();
+  }));
+  router.Invoke(router.Find("GET", "count"), Request{});
+  router.Invoke(router.Find("GET", "count"), Request{});
+  ASSERT_EQ(2, count);
+}
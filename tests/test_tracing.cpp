@@ -0,0 +1,179 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 6/6/20.
+
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/Tracing.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+
+
+namespace {
+
+class CollectingExporter : public TraceExporter {
+ public:
+  std::vector<TraceSample> samples;
+
+  void Export(const std::vector<TraceSample> &exported) override {
+    samples.insert(samples.end(), exported.begin(), exported.end());
+  }
+};
+
+void TraceRequest(Tracer *tracer, const char *method, const std::string &resource) {
+  RequestTrace trace;
+  trace.Begin(tracer, method, resource);
+  trace.Enter(TracePhase::kParse);
+  trace.Enter(TracePhase::kRoute);
+  trace.Enter(TracePhase::kHandler);
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  trace.Enter(TracePhase::kSerialize);
+  trace.set_status_code(200);
+  trace.Enter(TracePhase::kSend);
+  trace.End();
+}
+
+} // namespace
+
+
+TEST(TracingTest, recordsPhases) {
+  auto exporter = std::make_shared<CollectingExporter>();
+  Tracer tracer(exporter);
+
+  TraceRequest(&tracer, "GET", "users");
+  ASSERT_TRUE(exporter->samples.empty());
+  tracer.Flush();
+
+  ASSERT_EQ(1, exporter->samples.size());
+  const auto &sample = exporter->samples[0];
+  ASSERT_EQ("GET", sample.method);
+  ASSERT_EQ("users", sample.resource);
+  ASSERT_EQ(200, sample.status_code);
+  ASSERT_LE(sample.start_ns, sample.end_ns);
+  ASSERT_NE(0, sample.trace_id_high | sample.trace_id_low);
+
+  auto handler = static_cast<size_t>(TracePhase::kHandler);
+  ASSERT_GE(sample.phase_duration_ns[handler], 2000000);
+  for (size_t phase = 0; phase < kTracePhases; ++phase) {
+    ASSERT_GE(sample.phase_start_ns[phase], sample.start_ns) << TracePhaseName(TracePhase(phase));
+    ASSERT_LE(sample.phase_start_ns[phase] + sample.phase_duration_ns[phase], sample.end_ns);
+  }
+}
+
+
+TEST(TracingTest, accumulatesAcrossCalls) {
+  auto exporter = std::make_shared<CollectingExporter>();
+  Tracer tracer(exporter);
+
+  // As for POST requests, whose handler runs once per chunk uploaded.
+  RequestTrace trace;
+  trace.Begin(&tracer, "POST", "upload");
+  for (int i = 0; i < 3; ++i) {
+    trace.Enter(TracePhase::kHandler);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    trace.Pause();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  trace.End();
+  tracer.Flush();
+
+  ASSERT_EQ(1, exporter->samples.size());
+  const auto &sample = exporter->samples[0];
+  auto handler = sample.phase_duration_ns[static_cast<size_t>(TracePhase::kHandler)];
+  ASSERT_GE(handler, 3000000);
+  ASSERT_LT(handler, sample.end_ns - sample.start_ns - 10000000);
+  ASSERT_EQ(0, sample.phase_start_ns[static_cast<size_t>(TracePhase::kSend)]);
+}
+
+
+TEST(TracingTest, samplesOneInN) {
+  auto exporter = std::make_shared<CollectingExporter>();
+  Tracer tracer(exporter, 0.1);
+
+  for (int i = 0; i < 100; ++i) {
+    TraceRequest(&tracer, "GET", "item");
+  }
+  tracer.Flush();
+  ASSERT_EQ(10, exporter->samples.size());
+
+  Tracer disabled(exporter, 0);
+  RequestTrace trace;
+  trace.Begin(&disabled, "GET", "item");
+  ASSERT_FALSE(trace.active());
+
+  trace.Begin(nullptr, "GET", "item");
+  ASSERT_FALSE(trace.active());
+}
+
+
+TEST(TracingTest, boundedBuffers) {
+  auto exporter = std::make_shared<CollectingExporter>();
+  Tracer tracer(exporter, 1.0, std::chrono::milliseconds{0}, 4);
+
+  for (int i = 0; i < 10; ++i) {
+    TraceRequest(&tracer, "GET", "item");
+  }
+  ASSERT_EQ(6, tracer.dropped());
+  tracer.Flush();
+  ASSERT_EQ(4, exporter->samples.size());
+}
+
+
+TEST(TracingTest, perThreadBuffers) {
+  auto exporter = std::make_shared<CollectingExporter>();
+  {
+    Tracer tracer(exporter, 1.0, std::chrono::milliseconds{5});
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&tracer]() {
+        for (int j = 0; j < 5; ++j) {
+          TraceRequest(&tracer, "GET", "item");
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  // Destroying the tracer flushes whatever the background thread did not.
+  ASSERT_EQ(20, exporter->samples.size());
+}
+
+
+TEST(TracingTest, exportsJson) {
+  auto exporter = std::make_shared<CollectingExporter>();
+  Tracer tracer(exporter);
+  TraceRequest(&tracer, "GET", "us\"ers");
+  tracer.Flush();
+  ASSERT_EQ(1, exporter->samples.size());
+
+  std::ostringstream chrome;
+  ChromeTraceExporter::Write(exporter->samples[0], chrome);
+  auto events = chrome.str();
+  ASSERT_NE(std::string::npos, events.find(R"("name":"GET us\"ers")"));
+  ASSERT_NE(std::string::npos, events.find(R"("name":"handler")"));
+  ASSERT_NE(std::string::npos, events.find(R"("ph":"X")"));
+  ASSERT_EQ(1 + kTracePhases, std::count(events.begin(), events.end(), '\n'));
+
+  std::ostringstream otlp;
+  OtlpJsonExporter::Write(exporter->samples, "test", otlp);
+  auto spans = otlp.str();
+  ASSERT_EQ(0, spans.find(R"({"resourceSpans":[{"resource":{"attributes":[{"key":"service.name")"));
+  ASSERT_NE(std::string::npos, spans.find(R"("name":"serialize","kind":1)"));
+  ASSERT_NE(std::string::npos, spans.find(R"("kind":2)"));
+  ASSERT_NE(std::string::npos, spans.find(R"({"intValue":"200"})"));
+
+  size_t children = 0;
+  for (auto pos = spans.find("parentSpanId"); pos != std::string::npos;
+       pos = spans.find("parentSpanId", pos + 1)) {
+    ++children;
+  }
+  ASSERT_EQ(kTracePhases, children);
+}
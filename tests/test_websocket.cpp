@@ -0,0 +1,138 @@
+// Copyright (c) 2020 AlertAvert.com. All rights reserved.
+// Created by M. Massenzio (marco@alertavert.com) on 5/9/20.
+
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "api/rest/WebSocket.hpp"
+
+#include "tests.h"
+
+using namespace api::rest;
+
+
+namespace {
+
+const uint8_t kMask[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+/**
+ * Builds a frame as a client would send it (masked).
+ */
+std::string ClientFrame(WebSocketOpcode opcode, const std::string &payload, bool fin = true) {
+  auto frame = EncodeWebSocketFrame(opcode, payload);
+  if (!fin) {
+    frame[0] = static_cast<char>(frame[0] & 0x7F);
+  }
+  size_t header_len = frame.size() - payload.size();
+  frame[1] = static_cast<char>(frame[1] | 0x80);
+  frame.insert(header_len, reinterpret_cast<const char *>(kMask), 4);
+  ApplyWebSocketMask(&frame[header_len + 4], payload.size(), kMask);
+  return frame;
+}
+
+} // namespace
+
+
+TEST(WebSocketTest, acceptKey) {
+  // The example from RFC 6455, Section 1.3.
+  ASSERT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", WebSocketAcceptKey("dGhlIHNhbXBsZSBub25jZQ=="));
+}
+
+
+TEST(WebSocketTest, maskMatchesBytewiseXor) {
+  // Exercise all the vectorized paths, as well as the leftover bytes.
+  for (size_t len : {0, 1, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 100, 1027}) {
+    std::string data;
+    for (size_t i = 0; i < len; ++i) {
+      data.push_back(static_cast<char>(i * 31 + 7));
+    }
+    std::string expected{data};
+    for (size_t i = 0; i < len; ++i) {
+      expected[i] = static_cast<char>(expected[i] ^ kMask[i % 4]);
+    }
+
+    auto masked{data};
+    ApplyWebSocketMask(&masked[0], masked.size(), kMask);
+    ASSERT_EQ(expected, masked) << "Mismatch for length: " << len;
+
+    ApplyWebSocketMask(&masked[0], masked.size(), kMask);
+    ASSERT_EQ(data, masked);
+  }
+}
+
+
+TEST(WebSocketTest, encodeFrame) {
+  auto frame = EncodeWebSocketFrame(WebSocketOpcode::kText, "Hello");
+  ASSERT_EQ(std::string("\x81\x05Hello"), frame);
+
+  frame = EncodeWebSocketFrame(WebSocketOpcode::kBinary, std::string(300, 'x'));
+  ASSERT_EQ(304, frame.size());
+  ASSERT_EQ('\x82', frame[0]);
+  ASSERT_EQ(126, frame[1]);
+  ASSERT_EQ(1, frame[2]);
+  ASSERT_EQ(44, frame[3]);
+
+  frame = EncodeWebSocketFrame(WebSocketOpcode::kBinary, std::string(70000, 'x'));
+  ASSERT_EQ(70010, frame.size());
+  ASSERT_EQ(127, frame[1]);
+}
+
+
+TEST(WebSocketTest, parseFrames) {
+  WebSocketFrameParser parser;
+  std::vector<WebSocketFrame> frames;
+
+  auto data = ClientFrame(WebSocketOpcode::kText, "Hello") +
+      ClientFrame(WebSocketOpcode::kBinary, std::string(1000, 'z')) +
+      ClientFrame(WebSocketOpcode::kPing, "");
+  ASSERT_TRUE(parser.Parse(data.data(), data.size(), &frames));
+  ASSERT_EQ(3, frames.size());
+
+  ASSERT_TRUE(frames[0].fin);
+  ASSERT_EQ(WebSocketOpcode::kText, frames[0].opcode);
+  ASSERT_EQ("Hello", frames[0].payload);
+  ASSERT_EQ(WebSocketOpcode::kBinary, frames[1].opcode);
+  ASSERT_EQ(std::string(1000, 'z'), frames[1].payload);
+  ASSERT_EQ(WebSocketOpcode::kPing, frames[2].opcode);
+  ASSERT_TRUE(frames[2].payload.empty());
+}
+
+
+TEST(WebSocketTest, parsePartialFrames) {
+  WebSocketFrameParser parser;
+  std::vector<WebSocketFrame> frames;
+
+  auto data = ClientFrame(WebSocketOpcode::kText, "fragment ", false) +
+      ClientFrame(WebSocketOpcode::kContinuation, std::string(70000, 'a'));
+
+  // Feeding one byte at a time, the frames must only be returned once complete.
+  for (size_t i = 0; i < data.size(); ++i) {
+    ASSERT_TRUE(parser.Parse(data.data() + i, 1, &frames));
+  }
+  ASSERT_EQ(2, frames.size());
+  ASSERT_FALSE(frames[0].fin);
+  ASSERT_EQ("fragment ", frames[0].payload);
+  ASSERT_TRUE(frames[1].fin);
+  ASSERT_EQ(WebSocketOpcode::kContinuation, frames[1].opcode);
+  ASSERT_EQ(70000, frames[1].payload.size());
+}
+
+
+TEST(WebSocketTest, rejectsInvalidFrames) {
+  std::vector<WebSocketFrame> frames;
+
+  // Client frames must be masked.
+  auto unmasked = EncodeWebSocketFrame(WebSocketOpcode::kText, "Hello");
+  ASSERT_FALSE(WebSocketFrameParser().Parse(unmasked.data(), unmasked.size(), &frames));
+
+  // Control frames cannot be fragmented.
+  auto ping = ClientFrame(WebSocketOpcode::kPing, "", false);
+  ASSERT_FALSE(WebSocketFrameParser().Parse(ping.data(), ping.size(), &frames));
+
+  auto large = ClientFrame(WebSocketOpcode::kBinary, std::string(2048, 'x'));
+  ASSERT_FALSE(WebSocketFrameParser(1024).Parse(large.data(), large.size(), &frames));
+  ASSERT_TRUE(frames.empty());
+}